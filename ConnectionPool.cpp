@@ -0,0 +1,227 @@
+/**
+ * @file ConnectionPool.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "ConnectionPool.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "ConnectionPool";
+
+ConnectionPool *ConnectionPool::_instance = NULL;
+portMUX_TYPE ConnectionPool::_instanceLock = portMUX_INITIALIZER_UNLOCKED;
+
+// the wifi task (UPnP) and application tasks may race to create the pool:
+// only one instance is kept
+ConnectionPool &ConnectionPool::instance() {
+  if (!_instance) {
+    ConnectionPool *pool = new ConnectionPool();
+    portENTER_CRITICAL(&_instanceLock);
+    if (!_instance) {
+      _instance = pool;
+      pool = NULL;
+    }
+    portEXIT_CRITICAL(&_instanceLock);
+    delete pool;  // another task was first
+  }
+  return *_instance;
+}
+
+ConnectionPool::ConnectionPool() {
+  for (int i = 0; i < POOL_MAX_CONNECTIONS; i++) {
+    _entries[i].client = NULL;
+    _entries[i].port = 0;
+    _entries[i].inUse = false;
+    _entries[i].lastUsed = 0;
+  }
+  _mutex = xSemaphoreCreateMutex();
+}
+
+ConnectionPool::~ConnectionPool() {
+  if (_mutex) {
+    vSemaphoreDelete(_mutex);
+  }
+}
+
+/**
+ * @brief get a client connected to host:port, reusing an idle connection
+ * when there is one
+ *
+ * @param host
+ * @param port
+ * @param timeout connection timeout in ms if a new connection is needed
+ * @return TCPClient* NULL if no slot is free or the connection failed
+ */
+TCPClient *ConnectionPool::acquire(IPAddress host, int port,
+                                   uint32_t timeout) {
+  bool reused;
+  TCPClient *client = reserve(host, port, reused);
+  if (!client || reused) {
+    return client;
+  }
+  // connect() closes whatever the slot still had open
+  if (!client->connect(host, port, timeout)) {
+    release(client, false);
+    return NULL;
+  }
+  return client;
+}
+
+/**
+ * @brief same as acquire(), without waiting for a new connection: the
+ * client may still be connecting when returned, see
+ * TCPClient::connectDone(). Release it with keepAlive false if it fails.
+ *
+ * @param host
+ * @param port
+ * @return TCPClient* NULL if no slot is free or the connection failed
+ * right away
+ */
+TCPClient *ConnectionPool::acquireAsync(IPAddress host, int port) {
+  bool reused;
+  TCPClient *client = reserve(host, port, reused);
+  if (!client || reused) {
+    return client;
+  }
+  if (!client->startConnect(host, port)) {
+    release(client, false);
+    return NULL;
+  }
+  return client;
+}
+
+// mark an idle connection to host:port in use, or else a slot for a new
+// one (reused tells which)
+TCPClient *ConnectionPool::reserve(IPAddress host, int port, bool &reused) {
+  evictIdle();
+  reused = false;
+  xSemaphoreTake(_mutex, portMAX_DELAY);
+  int slot = -1;
+  for (int i = 0; i < POOL_MAX_CONNECTIONS; i++) {
+    poolEntry *entry = &_entries[i];
+    if (entry->inUse || !entry->client) {
+      continue;
+    }
+    if (entry->client->connected() && entry->host == host &&
+        entry->port == port) {
+      if (isAlive(entry->client)) {
+        entry->inUse = true;
+        entry->client->setReadLimit(-1);  // next response, length unknown
+        xSemaphoreGive(_mutex);
+        ESP_LOGD(TAG, "Reusing connection to %s:%d", host.toChar(), port);
+        reused = true;
+        return entry->client;
+      }
+      entry->client->close();
+    }
+  }
+  // prefer a slot with no open connection, else the least recently used one
+  for (int i = 0; i < POOL_MAX_CONNECTIONS; i++) {
+    poolEntry *entry = &_entries[i];
+    if (entry->inUse) {
+      continue;
+    }
+    if (!entry->client || !entry->client->connected()) {
+      slot = i;
+      break;
+    }
+    if (slot < 0 || entry->lastUsed < _entries[slot].lastUsed) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    xSemaphoreGive(_mutex);
+    ESP_LOGE(TAG, "No free connection for %s:%d", host.toChar(), port);
+    return NULL;
+  }
+  poolEntry *entry = &_entries[slot];
+  if (!entry->client) {
+    entry->client = new TCPClient(POOL_RX_BUFFER_SIZE);
+    // request/response traffic, don't let Nagle hold back small requests
+    entry->client->setNoDelay(true);
+  }
+  entry->host = host;
+  entry->port = port;
+  entry->inUse = true;
+  xSemaphoreGive(_mutex);
+  return entry->client;
+}
+
+/**
+ * @brief give a client back. The connection stays open for the next
+ * acquire() only if keepAlive is set and the response was read to its end
+ * (see TCPClient::setReadLimit), otherwise it is closed.
+ *
+ * @param client
+ * @param keepAlive false if the server asked to close, or on error
+ */
+void ConnectionPool::release(TCPClient *client, bool keepAlive) {
+  if (!client) {
+    return;
+  }
+  xSemaphoreTake(_mutex, portMAX_DELAY);
+  for (int i = 0; i < POOL_MAX_CONNECTIONS; i++) {
+    poolEntry *entry = &_entries[i];
+    if (entry->client != client) {
+      continue;
+    }
+    if (!keepAlive || client->readLimit() != 0 || client->available()) {
+      client->close();
+    }
+    entry->inUse = false;
+    entry->lastUsed = millis();
+    break;
+  }
+  xSemaphoreGive(_mutex);
+}
+
+/**
+ * @brief close connections idle for more than POOL_IDLE_TIMEOUT_MS and free
+ * their clients
+ */
+void ConnectionPool::evictIdle(void) {
+  xSemaphoreTake(_mutex, portMAX_DELAY);
+  unsigned long now = millis();
+  for (int i = 0; i < POOL_MAX_CONNECTIONS; i++) {
+    poolEntry *entry = &_entries[i];
+    if (entry->client && !entry->inUse &&
+        now - entry->lastUsed >= POOL_IDLE_TIMEOUT_MS) {
+      ESP_LOGD(TAG, "Evicting idle connection to %s:%d",
+               entry->host.toChar(), entry->port);
+      delete entry->client;  // closes it
+      entry->client = NULL;
+    }
+  }
+  xSemaphoreGive(_mutex);
+}
+
+// an idle keep-alive connection must have nothing to read: readable means
+// the server closed it (or sent garbage)
+bool ConnectionPool::isAlive(TCPClient *client) {
+  uint8_t c;
+  int received = lwip_recv(client->fd(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return received < 0 && (errno == EWOULDBLOCK || errno == EAGAIN);
+}
@@ -0,0 +1,78 @@
+/**
+ * @file ConnectionPool.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __CONNECTIONPOOL_H_
+#define __CONNECTIONPOOL_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "IPAddress.h"
+#include "TCPClient.h"
+#include "utils.h"
+
+#define POOL_MAX_CONNECTIONS 4
+#define POOL_IDLE_TIMEOUT_MS 15000  // idle connections are closed after that
+// rx ring of each pooled client, request/response traffic needs less than
+// TCP_RX_BUFFER_SIZE (longer lines and frames are read in pieces)
+#define POOL_RX_BUFFER_SIZE 2048
+
+typedef struct {
+  TCPClient *client;  // NULL if the slot was never used
+  IPAddress host;
+  int port;
+  bool inUse;
+  unsigned long lastUsed;
+} poolEntry;
+
+/**
+ * @brief Keeps TCP connections open between HTTP requests to the same
+ * host:port, so a sequence of requests (e.g. UPnP SOAP calls) pays for a
+ * single handshake. A client is borrowed with acquire() and handed back
+ * with release() once the whole response has been read.
+ */
+class ConnectionPool {
+ public:
+  static ConnectionPool &instance();
+
+  TCPClient *acquire(IPAddress host, int port, uint32_t timeout = 0);
+  TCPClient *acquireAsync(IPAddress host, int port);
+  void release(TCPClient *client, bool keepAlive = true);
+  void evictIdle(void);
+
+ private:
+  ConnectionPool();
+  ~ConnectionPool();
+  TCPClient *reserve(IPAddress host, int port, bool &reused);
+  bool isAlive(TCPClient *client);
+
+  static ConnectionPool *_instance;
+  static portMUX_TYPE _instanceLock;
+  poolEntry _entries[POOL_MAX_CONNECTIONS];
+  SemaphoreHandle_t _mutex = NULL;
+};
+
+#endif  // __CONNECTIONPOOL_H_
@@ -35,6 +35,7 @@
 static const char *TAG = "ESP-Now";
 
 EspNow *EspNow::_instance = NULL;
+TokenBucket *EspNow::_pacer = NULL;
 
 uint8_t EspNow::s_broadcast_mac[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF,
                                                      0xFF, 0xFF, 0xFF};
@@ -165,7 +166,7 @@ void EspNow::task(void *pvParameter) {
   /* Start sending broadcast ESPNOW data. */
   espnow_send_param_t *send_param = (espnow_send_param_t *)pvParameter;
   esp_err_t err;
-  err = esp_now_send(send_param->dest_mac, send_param->buffer, send_param->len);
+  err = send(send_param->dest_mac, send_param->buffer, send_param->len);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Initial Send error: %x", err);
     deinit(send_param);
@@ -206,8 +207,8 @@ void EspNow::task(void *pvParameter) {
       ESP_LOGI(TAG, "send data to " MACSTR "", MAC2STR(send_cb->mac_addr));
 
       /* Send the next data after the previous data is sent. */
-      if (esp_now_send(send_param->dest_mac, send_param->buffer,
-                       send_param->len) != ESP_OK) {
+      if (send(send_param->dest_mac, send_param->buffer,
+               send_param->len) != ESP_OK) {
         ESP_LOGE(TAG, "Send error");
         deinit(send_param);
         vTaskDelete(NULL);
@@ -265,8 +266,8 @@ void EspNow::task(void *pvParameter) {
             /* Start sending unicast ESPNOW data. */
             memcpy(send_param->dest_mac, recv_cb->mac_addr, ESP_NOW_ETH_ALEN);
             data_prepare(send_param);
-            if (esp_now_send(send_param->dest_mac, send_param->buffer,
-                             send_param->len) != ESP_OK) {
+            if (send(send_param->dest_mac, send_param->buffer,
+                     send_param->len) != ESP_OK) {
               ESP_LOGE(TAG, "Send error");
               deinit(send_param);
               vTaskDelete(NULL);
@@ -371,6 +372,22 @@ esp_err_t EspNow::init(Config *_config) {
   return ESP_OK;
 }
 
+/**
+ * @brief pace the frames sent, e.g. with the bucket UDP senders use to
+ * leave airtime to other traffic
+ *
+ * @param pacer NULL (default) to send right away
+ */
+void EspNow::setPacer(TokenBucket *pacer) { _pacer = pacer; }
+
+// every frame goes through the pacer, if any
+esp_err_t EspNow::send(const uint8_t *mac, const uint8_t *data, int len) {
+  if (_pacer) {
+    _pacer->pace(len);
+  }
+  return esp_now_send(mac, data, len);
+}
+
 void EspNow::deinit(espnow_send_param_t *send_param) {
   free(send_param->buffer);
   free(send_param);
@@ -36,6 +36,7 @@
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "Config.h"
+#include "TokenBucket.h"
 
 #define ESPNOW_MAXDELAY 512
 #define REMOTE_USB_ESPNOW_ID "RemoteUSB"
@@ -129,9 +130,13 @@ public:
   static void deinit(espnow_send_param_t *send_param);
   EspNow &instance();
   esp_err_t init(Config *config);
+  static void setPacer(TokenBucket *pacer);
 
  private:
+  static esp_err_t send(const uint8_t *mac, const uint8_t *data, int len);
+
   static EspNow *_instance;
+  static TokenBucket *_pacer;
   Config *config;
   QueueHandle_t s_queue;
   static uint8_t s_broadcast_mac[ESP_NOW_ETH_ALEN];
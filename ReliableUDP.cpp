@@ -0,0 +1,535 @@
+/**
+ * @file ReliableUDP.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "ReliableUDP.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "ReliableUDP";
+
+#define RUDP_MAGIC 0xa7
+#define RUDP_DATA 1
+#define RUDP_ACK 2
+
+// _events bits, kept up to date under _lock: every task waiting in send()
+// or flush() wakes when its bit is set
+#define RUDP_ROOM BIT0  // the window has room, or failed() or stopping
+#define RUDP_IDLE BIT1  // nothing in flight, or failed() or stopping
+
+// numbers in network order
+typedef struct __attribute__((packed)) {
+  uint8_t magic;
+  uint8_t type;      // RUDP_DATA
+  uint16_t reserved;
+  uint32_t seq;
+} rudpDataHeader;
+
+typedef struct __attribute__((packed)) {
+  uint8_t magic;
+  uint8_t type;      // RUDP_ACK
+  uint16_t reserved;
+  uint32_t next;  // every packet before that was received
+  uint32_t sack;  // bit i: next + 1 + i was received
+} rudpAckHeader;
+
+static_assert(sizeof(rudpDataHeader) == RUDP_HEADER_SIZE, "header size");
+
+// sequence numbers wrap around
+static inline bool seqBefore(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+static TickType_t msToTicks(uint32_t timeout) {
+  return timeout == portMAX_DELAY ? portMAX_DELAY : pdMS_TO_TICKS(timeout);
+}
+
+ReliableUDP::ReliableUDP() {}
+
+ReliableUDP::~ReliableUDP() { stop(); }
+
+/**
+ * @brief bind a port and start the task exchanging packets with the peer
+ *
+ * @param port local port
+ * @param peerIp
+ * @param peerPort datagrams from anywhere else are ignored
+ * @param callback gets the peer's packets in order, may be NULL to only
+ * send. It runs on the task: it must not wait for send() (use timeout 0).
+ * @param arg passed to the callback
+ * @param window packets in flight, up to RUDP_MAX_WINDOW, the same at both
+ * ends
+ * @param maxPayload largest packet, up to RUDP_MAX_PAYLOAD. The buffers
+ * take 2 x window x maxPayload bytes.
+ * @return true
+ * @return false bad arguments, or allocation/socket/task creation failed
+ */
+bool ReliableUDP::begin(uint16_t port, IPAddress peerIp, uint16_t peerPort,
+                        rudp_receive_callback callback, void *arg, int window,
+                        size_t maxPayload) {
+  stop();
+  if (!peerPort || window < 1 || window > RUDP_MAX_WINDOW || !maxPayload ||
+      maxPayload > RUDP_MAX_PAYLOAD) {
+    return false;
+  }
+  _tx = (rudpTxSlot *)calloc(window, sizeof(rudpTxSlot));
+  _rx = (rudpRxSlot *)calloc(window, sizeof(rudpRxSlot));
+  _pool = (uint8_t *)malloc(window * (2 * maxPayload + 1));
+  _lock = xSemaphoreCreateMutex();
+  _events = xEventGroupCreate();
+  _exited = xSemaphoreCreateBinary();
+  if (!_tx || !_rx || !_pool || !_lock || !_events || !_exited) {
+    ESP_LOGE(TAG, "Could not allocate a window of %d packets", window);
+    stop();
+    return false;
+  }
+  for (int i = 0; i < window; i++) {
+    _tx[i].data = _pool + i * maxPayload;
+    _rx[i].data = _pool + window * maxPayload + i * (maxPayload + 1);
+  }
+  if (!_udp.begin(port)) {
+    ESP_LOGE(TAG, "Unable to bind port %d", port);
+    stop();
+    return false;
+  }
+  _peerIp = peerIp;
+  _peerPort = peerPort;
+  _callback = callback;
+  _arg = arg;
+  _window = window;
+  _maxPayload = maxPayload;
+  _sendBase = _nextSeq = _rcvNext = 0;
+  _srttUs = _rttVarUs = 0;
+  _rtoUs = RUDP_INITIAL_RTO_MS * 1000UL;
+  _failed = false;
+  _stats = {};
+  _running = true;
+  updateEvents();
+  if (xTaskCreate(rudpTask, "rudp", RUDP_TASK_STACK_SIZE, this,
+                  RUDP_TASK_PRIORITY, NULL) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start the task");
+    _running = false;
+    stop();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief stop the task (within RUDP_WAIT_MS) and close the socket. Packets
+ * not acknowledged yet are dropped, see flush().
+ */
+void ReliableUDP::stop(void) {
+  if (_running) {
+    _running = false;
+    xSemaphoreTake(_exited, portMAX_DELAY);
+  }
+  if (_lock && _events) {
+    // wake send() and flush(), and let them return before tearing down
+    xSemaphoreTake(_lock, portMAX_DELAY);
+    updateEvents();
+    while (_waiters) {
+      xSemaphoreGive(_lock);
+      vTaskDelay(1);
+      xSemaphoreTake(_lock, portMAX_DELAY);
+    }
+    xSemaphoreGive(_lock);
+  }
+  _udp.stop();
+  free(_tx);
+  free(_rx);
+  free(_pool);
+  _tx = NULL;
+  _rx = NULL;
+  _pool = NULL;
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+    _lock = NULL;
+  }
+  if (_events) {
+    vEventGroupDelete(_events);
+    _events = NULL;
+  }
+  if (_exited) {
+    vSemaphoreDelete(_exited);
+    _exited = NULL;
+  }
+}
+
+/**
+ * @brief queue a packet and send it, waiting for room in the window
+ *
+ * @param buffer copied, can be reused on return
+ * @param len up to the maxPayload given to begin()
+ * @param timeout in ms to wait for room in the window
+ * @return true
+ * @return false too long, window still full, or failed()
+ */
+bool ReliableUDP::send(const uint8_t *buffer, size_t len, uint32_t timeout) {
+  if (!_running || len > _maxPayload) {
+    return false;
+  }
+  TickType_t start = xTaskGetTickCount();
+  TickType_t ticks = msToTicks(timeout);
+  bool room = false;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _waiters++;
+  while (_running && !_failed) {
+    if (_nextSeq - _sendBase < (uint32_t)_window) {
+      room = true;
+      break;
+    }
+    xSemaphoreGive(_lock);
+    TickType_t waited = xTaskGetTickCount() - start;
+    if (ticks != portMAX_DELAY && waited >= ticks) {
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      break;
+    }
+    xEventGroupWaitBits(_events, RUDP_ROOM, pdFALSE, pdFALSE,
+                        ticks == portMAX_DELAY ? portMAX_DELAY
+                                               : ticks - waited);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+  }
+  _waiters--;
+  if (!room) {
+    xSemaphoreGive(_lock);
+    return false;
+  }
+  rudpTxSlot *slot = &_tx[_nextSeq % _window];
+  slot->seq = _nextSeq++;
+  slot->len = len;
+  slot->retries = 0;
+  slot->sacked = 0;
+  slot->acked = false;
+  memcpy(slot->data, buffer, len);
+  _stats.sent++;
+  transmitSlot(slot);  // the timer resends it if that fails
+  updateEvents();
+  xSemaphoreGive(_lock);
+  return true;
+}
+
+/**
+ * @brief wait until every packet sent is acknowledged
+ *
+ * @param timeout in ms
+ * @return true
+ * @return false timeout, or failed()
+ */
+bool ReliableUDP::flush(uint32_t timeout) {
+  if (!_running) {
+    return false;
+  }
+  TickType_t start = xTaskGetTickCount();
+  TickType_t ticks = msToTicks(timeout);
+  bool idle = false;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _waiters++;
+  while (_running && !_failed) {
+    if (_nextSeq == _sendBase) {
+      idle = true;
+      break;
+    }
+    xSemaphoreGive(_lock);
+    TickType_t waited = xTaskGetTickCount() - start;
+    if (ticks != portMAX_DELAY && waited >= ticks) {
+      xSemaphoreTake(_lock, portMAX_DELAY);
+      break;
+    }
+    xEventGroupWaitBits(_events, RUDP_IDLE, pdFALSE, pdFALSE,
+                        ticks == portMAX_DELAY ? portMAX_DELAY
+                                               : ticks - waited);
+    xSemaphoreTake(_lock, portMAX_DELAY);
+  }
+  _waiters--;
+  xSemaphoreGive(_lock);
+  return idle;
+}
+
+/**
+ * @brief
+ *
+ * @return true a packet went unacknowledged after RUDP_MAX_RETRIES
+ * retransmissions: the peer is gone, begin() again to start over
+ */
+bool ReliableUDP::failed(void) { return _failed; }
+
+/**
+ * @brief
+ *
+ * @return int packets sent and not acknowledged yet
+ */
+int ReliableUDP::inFlight(void) {
+  if (!_lock) {
+    return 0;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  int count = _nextSeq - _sendBase;
+  xSemaphoreGive(_lock);
+  return count;
+}
+
+/**
+ * @brief drop that share of the outgoing datagrams (data and ACKs), to test
+ * recovery
+ *
+ * @param percent 0 (default) to 100
+ */
+void ReliableUDP::setLossRate(uint8_t percent) { _lossRate = percent; }
+
+void ReliableUDP::getStats(rudpStats &stats) {
+  stats = _stats;
+  stats.rttUs = _srttUs;
+  stats.rtoUs = _rtoUs;
+}
+
+// one datagram to the peer, under _lock (the UDPClient packet is shared)
+bool ReliableUDP::transmit(const uint8_t *header, size_t headerLen,
+                           const uint8_t *data, size_t len) {
+  if (_lossRate && esp_random() % 100 < _lossRate) {
+    _stats.lost++;
+    return true;
+  }
+  if (!_udp.beginPacket(_peerIp, _peerPort)) {
+    return false;
+  }
+  _udp.write(header, headerLen);
+  if (len) {
+    _udp.write(data, len);
+  }
+  return _udp.endPacket();
+}
+
+bool ReliableUDP::transmitSlot(rudpTxSlot *slot) {
+  rudpDataHeader header;
+  header.magic = RUDP_MAGIC;
+  header.type = RUDP_DATA;
+  header.reserved = 0;
+  header.seq = htonl(slot->seq);
+  slot->sentAt = micros();
+  return transmit((const uint8_t *)&header, sizeof(header), slot->data,
+                  slot->len);
+}
+
+void ReliableUDP::sendAck(void) {
+  rudpAckHeader ack;
+  ack.magic = RUDP_MAGIC;
+  ack.type = RUDP_ACK;
+  ack.reserved = 0;
+  ack.next = htonl(_rcvNext);
+  uint32_t sack = 0;
+  for (int i = 1; i < _window; i++) {
+    if (_rx[(_rcvNext + i) % _window].present) {
+      sack |= 1UL << (i - 1);
+    }
+  }
+  ack.sack = htonl(sack);
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  transmit((const uint8_t *)&ack, sizeof(ack), NULL, 0);
+  _stats.acksSent++;
+  xSemaphoreGive(_lock);
+}
+
+// true if it was data, to acknowledge
+bool ReliableUDP::received(udpPacket &packet) {
+  if (packet.ip != _peerIp || packet.port != _peerPort ||
+      packet.len < sizeof(rudpDataHeader) || packet.data[0] != RUDP_MAGIC) {
+    return false;
+  }
+  if (packet.data[1] == RUDP_DATA) {
+    rudpDataHeader header;
+    memcpy(&header, packet.data, sizeof(header));
+    receivedData(ntohl(header.seq), packet.data + sizeof(header),
+                 packet.len - sizeof(header));
+    return true;
+  }
+  if (packet.data[1] == RUDP_ACK && packet.len == sizeof(rudpAckHeader)) {
+    rudpAckHeader ack;
+    memcpy(&ack, packet.data, sizeof(ack));
+    receivedAck(ntohl(ack.next), ntohl(ack.sack));
+  }
+  return false;
+}
+
+void ReliableUDP::receivedData(uint32_t seq, const uint8_t *data, size_t len) {
+  // already delivered (our ACK was lost), or beyond the window
+  if (seqBefore(seq, _rcvNext) || seq - _rcvNext >= (uint32_t)_window ||
+      len > _maxPayload) {
+    _stats.duplicates++;
+    return;
+  }
+  rudpRxSlot *slot = &_rx[seq % _window];
+  if (slot->present) {
+    _stats.duplicates++;
+    return;
+  }
+  memcpy(slot->data, data, len);
+  slot->data[len] = 0;
+  slot->len = len;
+  slot->present = true;
+  // deliver what's now in order
+  while ((slot = &_rx[_rcvNext % _window])->present) {
+    if (_callback) {
+      _callback(slot->data, slot->len, _arg);
+    }
+    slot->present = false;
+    _rcvNext++;
+    _stats.delivered++;
+  }
+}
+
+void ReliableUDP::receivedAck(uint32_t next, uint32_t sack) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _stats.acksReceived++;
+  unsigned long now = micros();
+  uint32_t newest = _sendBase;  // newest packet the peer has
+  rudpTxSlot *sample = NULL;
+  for (uint32_t seq = _sendBase; seq != _nextSeq; seq++) {
+    rudpTxSlot *slot = &_tx[seq % _window];
+    uint32_t bit = seq - next - 1;
+    bool acked = seqBefore(seq, next) ||
+                 (seqBefore(next, seq) && bit < 32 && (sack & (1UL << bit)));
+    if (!acked || slot->acked) {
+      continue;
+    }
+    slot->acked = true;
+    newest = seq + 1;
+    // Karn: a retransmitted packet's ACK could be for either copy
+    sample = slot->retries ? NULL : slot;
+  }
+  // the newest is what triggered this ACK, older ones may have waited for
+  // a lost packet before them
+  if (sample) {
+    sampleRtt(now - sample->sentAt);
+  }
+  // later packets got there first: resend the ones before them without
+  // waiting for the timer
+  for (uint32_t seq = _sendBase; seqBefore(seq, newest); seq++) {
+    rudpTxSlot *slot = &_tx[seq % _window];
+    if (!slot->acked && ++slot->sacked == RUDP_FAST_RETRANSMIT) {
+      slot->retries++;
+      _stats.retransmits++;
+      transmitSlot(slot);
+    }
+  }
+  while (_sendBase != _nextSeq && _tx[_sendBase % _window].acked) {
+    _sendBase++;
+  }
+  updateEvents();
+  xSemaphoreGive(_lock);
+}
+
+// reflect the window in _events, under _lock
+void ReliableUDP::updateEvents(void) {
+  EventBits_t bits = RUDP_ROOM | RUDP_IDLE;
+  if (_running && !_failed) {
+    if (_nextSeq - _sendBase >= (uint32_t)_window) {
+      bits &= ~RUDP_ROOM;
+    }
+    if (_nextSeq != _sendBase) {
+      bits &= ~RUDP_IDLE;
+    }
+  }
+  xEventGroupClearBits(_events, ~bits & (RUDP_ROOM | RUDP_IDLE));
+  xEventGroupSetBits(_events, bits);
+}
+
+// RFC 6298
+void ReliableUDP::sampleRtt(unsigned long rtt) {
+  if (!_srttUs) {
+    _srttUs = rtt ? rtt : 1;
+    _rttVarUs = rtt / 2;
+  } else {
+    unsigned long delta = rtt > _srttUs ? rtt - _srttUs : _srttUs - rtt;
+    _rttVarUs = (3 * _rttVarUs + delta) / 4;
+    _srttUs = (7 * _srttUs + rtt) / 8;
+  }
+  _rtoUs = _srttUs + 4 * _rttVarUs;
+  _rtoUs = max(_rtoUs, RUDP_MIN_RTO_MS * 1000UL);
+  _rtoUs = min(_rtoUs, RUDP_MAX_RTO_MS * 1000UL);
+}
+
+// resend what timed out, return how long until the next timeout (ms)
+uint32_t ReliableUDP::checkTimers(void) {
+  uint32_t wait = RUDP_WAIT_MS;
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  unsigned long now = micros();
+  for (uint32_t seq = _sendBase; seq != _nextSeq && !_failed; seq++) {
+    rudpTxSlot *slot = &_tx[seq % _window];
+    if (slot->acked) {
+      continue;
+    }
+    unsigned long elapsed = now - slot->sentAt;
+    if (elapsed < _rtoUs) {
+      wait = min(wait, (uint32_t)((_rtoUs - elapsed) / 1000 + 1));
+      continue;
+    }
+    if (slot->retries >= RUDP_MAX_RETRIES) {
+      ESP_LOGW(TAG, "Packet %lu not acknowledged by %s:%d, giving up",
+               (unsigned long)seq, _peerIp.toChar(), _peerPort);
+      _failed = true;
+      updateEvents();  // wake send() and flush()
+      break;
+    }
+    // back off until a new sample (RFC 6298 5.5), the oldest packet
+    // stands for the single timer there
+    if (seq == _sendBase) {
+      _rtoUs = min(2 * _rtoUs, RUDP_MAX_RTO_MS * 1000UL);
+    }
+    slot->retries++;
+    slot->sacked = 0;
+    _stats.retransmits++;
+    transmitSlot(slot);
+    wait = min(wait, (uint32_t)(_rtoUs / 1000 + 1));
+  }
+  xSemaphoreGive(_lock);
+  return wait;
+}
+
+void ReliableUDP::run(void) {
+  udpPacket packet;
+  uint32_t wait = RUDP_WAIT_MS;
+  while (_running) {
+    _udp.waitAvailable(wait);
+    bool ack = false;
+    while (_udp.parsePacket() > 0 && _udp.packet(packet)) {
+      ack |= received(packet);
+    }
+    // one ACK for everything just received
+    if (ack) {
+      sendAck();
+    }
+    wait = checkTimers();
+  }
+}
+
+void ReliableUDP::rudpTask(void *arg) {
+  ReliableUDP *rudp = (ReliableUDP *)arg;
+  rudp->run();
+  xSemaphoreGive(rudp->_exited);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,155 @@
+/**
+ * @file ReliableUDP.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __RELIABLEUDP_H_
+#define __RELIABLEUDP_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "UDPClient.h"
+#include "utils.h"
+
+#define RUDP_HEADER_SIZE 8  // in front of each data packet
+#define RUDP_MAX_PAYLOAD (UDP_MAX_PAYLOAD - RUDP_HEADER_SIZE)
+#define RUDP_WINDOW 16      // default, packets in flight
+#define RUDP_MAX_WINDOW 32  // what a selective ACK can describe
+#define RUDP_INITIAL_RTO_MS 200  // until the first RTT sample (LAN)
+#define RUDP_MIN_RTO_MS 20
+#define RUDP_MAX_RTO_MS 2000
+#define RUDP_MAX_RETRIES 10  // per packet, then the link is down
+#define RUDP_FAST_RETRANSMIT 3  // ACKs of later packets before resending
+#define RUDP_TASK_STACK_SIZE 4096
+#define RUDP_TASK_PRIORITY 5
+#define RUDP_WAIT_MS 100  // longest sleep of the task
+
+// called on the ReliableUDP task for each packet, in order. The data is only
+// valid during the call.
+typedef void (*rudp_receive_callback)(const uint8_t *data, size_t len,
+                                      void *arg);
+
+typedef struct {
+  uint32_t sent;         // data packets, first transmissions
+  uint32_t retransmits;  // on timeout or fast retransmit
+  uint32_t delivered;    // to the callback
+  uint32_t duplicates;   // received again, or beyond the window
+  uint32_t acksSent;
+  uint32_t acksReceived;
+  uint32_t lost;    // outgoing datagrams dropped by setLossRate()
+  uint32_t rttUs;   // smoothed round trip
+  uint32_t rtoUs;   // current retransmit timeout
+} rudpStats;
+
+// a packet sent and not acknowledged yet
+typedef struct {
+  uint32_t seq;
+  uint16_t len;
+  uint8_t retries;
+  uint8_t sacked;  // ACKs for later packets since it was sent
+  bool acked;
+  unsigned long sentAt;  // micros()
+  uint8_t *data;  // in the preallocated pool
+} rudpTxSlot;
+
+// a packet received ahead of the next one expected
+typedef struct {
+  bool present;
+  uint16_t len;
+  uint8_t *data;  // in the preallocated pool, +1 byte to terminate
+} rudpRxSlot;
+
+/**
+ * @brief reliable, in-order datagrams with one peer, for lower latency than
+ * TCP on a LAN. Packets carry sequence numbers; the receiver acknowledges
+ * the next one it expects plus a bitmap of those received past it
+ * (selective ACK), so the sender only resends what was lost, either after a
+ * retransmit timeout computed from the measured round trip or when later
+ * packets are acknowledged first. Up to a window of packets is in flight;
+ * both ends use the same window and start at sequence 0, so they are
+ * started (and restarted) together. Buffers for the window are allocated
+ * once by begin().
+ */
+class ReliableUDP {
+ public:
+  ReliableUDP();
+  ~ReliableUDP();
+  bool begin(uint16_t port, IPAddress peerIp, uint16_t peerPort,
+             rudp_receive_callback callback, void *arg = NULL,
+             int window = RUDP_WINDOW, size_t maxPayload = RUDP_MAX_PAYLOAD);
+  void stop(void);
+  bool send(const uint8_t *buffer, size_t len,
+            uint32_t timeout = portMAX_DELAY);
+  bool flush(uint32_t timeout = portMAX_DELAY);
+  bool failed(void);
+  int inFlight(void);
+  void setLossRate(uint8_t percent);
+  void getStats(rudpStats &stats);
+
+ private:
+  void run(void);
+  bool received(udpPacket &packet);
+  void receivedData(uint32_t seq, const uint8_t *data, size_t len);
+  void receivedAck(uint32_t next, uint32_t sack);
+  void sendAck(void);
+  bool transmit(const uint8_t *header, size_t headerLen, const uint8_t *data,
+                size_t len);
+  bool transmitSlot(rudpTxSlot *slot);
+  uint32_t checkTimers(void);
+  void updateEvents(void);
+  void sampleRtt(unsigned long rtt);
+  static void rudpTask(void *arg);
+
+  UDPClient _udp;
+  IPAddress _peerIp;
+  uint16_t _peerPort = 0;
+  rudp_receive_callback _callback = NULL;
+  void *_arg = NULL;
+  int _window = 0;
+  size_t _maxPayload = 0;
+  bool _running = false;
+  bool _failed = false;
+  uint8_t _lossRate = 0;
+  uint8_t *_pool = NULL;
+  // sender, under _lock
+  rudpTxSlot *_tx = NULL;  // seq % _window
+  uint32_t _sendBase = 0;  // oldest packet not acknowledged
+  uint32_t _nextSeq = 0;
+  unsigned long _srttUs = 0;
+  unsigned long _rttVarUs = 0;
+  unsigned long _rtoUs = 0;
+  // receiver, on the task only
+  rudpRxSlot *_rx = NULL;  // seq % _window
+  uint32_t _rcvNext = 0;   // next packet to deliver
+  rudpStats _stats = {};
+  SemaphoreHandle_t _lock = NULL;
+  EventGroupHandle_t _events = NULL;  // RUDP_ROOM, RUDP_IDLE
+  int _waiters = 0;                   // in send() or flush(), under _lock
+  SemaphoreHandle_t _exited = NULL;
+};
+
+#endif  // __RELIABLEUDP_H_
@@ -0,0 +1,296 @@
+/**
+ * @file SocketReactor.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "SocketReactor.h"
+#include "esp_log.h"
+
+static const char *TAG = "SocketReactor";
+
+SocketReactor *SocketReactor::_instance = NULL;
+portMUX_TYPE SocketReactor::_instanceLock = portMUX_INITIALIZER_UNLOCKED;
+
+// tasks may race to create the reactor: only one instance is kept (it
+// doesn't start its task before the first add())
+SocketReactor &SocketReactor::instance() {
+  if (!_instance) {
+    SocketReactor *reactor = new SocketReactor();
+    portENTER_CRITICAL(&_instanceLock);
+    if (!_instance) {
+      _instance = reactor;
+      reactor = NULL;
+    }
+    portEXIT_CRITICAL(&_instanceLock);
+    delete reactor;  // another task was first
+  }
+  return *_instance;
+}
+
+SocketReactor::SocketReactor() {
+  for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+    _entries[i].sock = -1;
+  }
+  _mutex = xSemaphoreCreateRecursiveMutex();
+}
+
+SocketReactor::~SocketReactor() {
+  if (_mutex) {
+    vSemaphoreDelete(_mutex);
+  }
+}
+
+/**
+ * @brief start watching a socket
+ *
+ * @param sock
+ * @param events REACTOR_READ and/or REACTOR_WRITE, optionally REACTOR_ONESHOT
+ * @param callback called from the reactor task when the socket is ready
+ * @param arg passed to the callback
+ * @return true
+ * @return false no free slot, or socket already registered
+ */
+bool SocketReactor::add(int sock, int events, reactor_callback callback,
+                        void *arg) {
+  if (sock < 0 || !callback || !start()) {
+    return false;
+  }
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+  int slot = -1;
+  for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+    if (_entries[i].sock == sock) {
+      ESP_LOGE(TAG, "Socket %d already registered", sock);
+      xSemaphoreGiveRecursive(_mutex);
+      return false;
+    }
+    if (_entries[i].sock < 0 && slot < 0) {
+      slot = i;
+    }
+  }
+  if (slot < 0) {
+    ESP_LOGE(TAG, "No free slot for socket %d", sock);
+    xSemaphoreGiveRecursive(_mutex);
+    return false;
+  }
+  _entries[slot].events = events;
+  _entries[slot].callback = callback;
+  _entries[slot].arg = arg;
+  _entries[slot].sock = sock;
+  xSemaphoreGiveRecursive(_mutex);
+  wakeup();
+  return true;
+}
+
+bool SocketReactor::modify(int sock, int events) {
+  if (!_mutex) {
+    return false;
+  }
+  bool found = false;
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+  for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+    if (_entries[i].sock == sock) {
+      _entries[i].events = events;
+      found = true;
+      break;
+    }
+  }
+  xSemaphoreGiveRecursive(_mutex);
+  if (found) {
+    wakeup();
+  }
+  return found;
+}
+
+/**
+ * @brief stop watching a socket. Once this returns, its callback is not
+ * running and won't be called anymore (it can be called from the callback
+ * itself).
+ *
+ * @param sock
+ */
+void SocketReactor::remove(int sock) {
+  if (!_mutex) {
+    return;
+  }
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+  for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+    if (_entries[i].sock == sock) {
+      _entries[i].sock = -1;
+      break;
+    }
+  }
+  xSemaphoreGiveRecursive(_mutex);
+  wakeup();
+}
+
+bool SocketReactor::start(void) {
+  if (!_mutex) {
+    ESP_LOGE(TAG, "Could not create mutex");
+    return false;
+  }
+  // concurrent first add()s must not start two tasks
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+  if (_task) {
+    xSemaphoreGiveRecursive(_mutex);
+    return true;
+  }
+
+  // a datagram sent to ourselves on loopback wakes select() up when the
+  // socket list changes, otherwise changes wait for the idle timeout
+  _wakeSock = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (_wakeSock >= 0) {
+    memset(&_wakeAddr, 0, sizeof(_wakeAddr));
+    _wakeAddr.sin_family = AF_INET;
+    _wakeAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    _wakeAddr.sin_port = 0;
+    socklen_t len = sizeof(_wakeAddr);
+    if (lwip_bind(_wakeSock, (struct sockaddr *)&_wakeAddr,
+                  sizeof(_wakeAddr)) < 0 ||
+        lwip_getsockname(_wakeSock, (struct sockaddr *)&_wakeAddr, &len) < 0) {
+      ESP_LOGW(TAG, "No loopback wakeup socket: errno %d", errno);
+      lwip_close(_wakeSock);
+      _wakeSock = -1;
+    } else {
+      lwip_fcntl(_wakeSock, F_SETFL, O_NONBLOCK);
+    }
+  }
+
+  if (xTaskCreate(task, "reactor", REACTOR_TASK_STACK_SIZE, this,
+                  REACTOR_TASK_PRIORITY, &_task) != pdPASS) {
+    ESP_LOGE(TAG, "Could not create reactor task");
+    _task = NULL;
+    if (_wakeSock >= 0) {
+      lwip_close(_wakeSock);
+      _wakeSock = -1;
+    }
+    xSemaphoreGiveRecursive(_mutex);
+    return false;
+  }
+  xSemaphoreGiveRecursive(_mutex);
+  return true;
+}
+
+void SocketReactor::wakeup(void) {
+  if (_wakeSock >= 0 && xTaskGetCurrentTaskHandle() != _task) {
+    uint8_t dummy = 0;
+    lwip_sendto(_wakeSock, &dummy, 1, 0, (struct sockaddr *)&_wakeAddr,
+                sizeof(_wakeAddr));
+  }
+}
+
+void SocketReactor::task(void *arg) { ((SocketReactor *)arg)->run(); }
+
+void SocketReactor::run(void) {
+  fd_set readSet, writeSet;
+  while (true) {
+    FD_ZERO(&readSet);
+    FD_ZERO(&writeSet);
+    int maxSock = -1;
+    if (_wakeSock >= 0) {
+      FD_SET(_wakeSock, &readSet);
+      maxSock = _wakeSock;
+    }
+    xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+    for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+      reactorEntry &entry = _entries[i];
+      if (entry.sock < 0) {
+        continue;
+      }
+      if (entry.events & REACTOR_READ) {
+        FD_SET(entry.sock, &readSet);
+      }
+      if (entry.events & REACTOR_WRITE) {
+        FD_SET(entry.sock, &writeSet);
+      }
+      maxSock = max(maxSock, entry.sock);
+    }
+    xSemaphoreGiveRecursive(_mutex);
+
+    struct timeval timeout = {.tv_sec = REACTOR_IDLE_TIMEOUT_MS / 1000,
+                              .tv_usec = (REACTOR_IDLE_TIMEOUT_MS % 1000) * 1000};
+    int ready = lwip_select(maxSock + 1, &readSet, &writeSet, NULL, &timeout);
+    if (ready < 0) {
+      // most likely a socket closed before being removed
+      ESP_LOGW(TAG, "select failed: errno %d", errno);
+      dropInvalid();
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
+    }
+    if (ready == 0) {
+      continue;
+    }
+
+    if (_wakeSock >= 0 && FD_ISSET(_wakeSock, &readSet)) {
+      uint8_t dummy[16];
+      while (lwip_recv(_wakeSock, dummy, sizeof(dummy), MSG_DONTWAIT) > 0) {
+      }
+    }
+
+    // callbacks run with the lock held, so remove() from another task waits
+    // for a running callback to finish
+    xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+    for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+      reactorEntry &entry = _entries[i];
+      if (entry.sock < 0) {
+        continue;
+      }
+      int events = 0;
+      if ((entry.events & REACTOR_READ) && FD_ISSET(entry.sock, &readSet)) {
+        events |= REACTOR_READ;
+      }
+      if ((entry.events & REACTOR_WRITE) && FD_ISSET(entry.sock, &writeSet)) {
+        events |= REACTOR_WRITE;
+      }
+      if (!events) {
+        continue;
+      }
+      int sock = entry.sock;
+      if (entry.events & REACTOR_ONESHOT) {
+        entry.sock = -1;
+      }
+      entry.callback(sock, events, entry.arg);
+    }
+    xSemaphoreGiveRecursive(_mutex);
+  }
+}
+
+// after select() failed: stop watching the sockets that aren't valid
+// anymore, or select() would keep failing and no other socket be served
+void SocketReactor::dropInvalid(void) {
+  xSemaphoreTakeRecursive(_mutex, portMAX_DELAY);
+  for (int i = 0; i < REACTOR_MAX_SOCKETS; i++) {
+    reactorEntry &entry = _entries[i];
+    if (entry.sock >= 0 && lwip_fcntl(entry.sock, F_GETFL, 0) < 0) {
+      ESP_LOGW(TAG, "Socket %d closed without being removed, dropped",
+               entry.sock);
+      entry.sock = -1;
+    }
+  }
+  xSemaphoreGiveRecursive(_mutex);
+  if (_wakeSock >= 0 && lwip_fcntl(_wakeSock, F_GETFL, 0) < 0) {
+    ESP_LOGW(TAG, "Wakeup socket lost");
+    _wakeSock = -1;
+  }
+}
@@ -0,0 +1,88 @@
+/**
+ * @file SocketReactor.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __SOCKETREACTOR_H_
+#define __SOCKETREACTOR_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "utils.h"
+
+#define REACTOR_MAX_SOCKETS 16
+#define REACTOR_TASK_STACK_SIZE 4096
+#define REACTOR_TASK_PRIORITY 5
+#define REACTOR_IDLE_TIMEOUT_MS 1000  // select() timeout when nothing happens
+
+// readiness events, can be or'ed
+#define REACTOR_READ 0x01
+#define REACTOR_WRITE 0x02
+#define REACTOR_ONESHOT 0x04  // unregister the socket after the first event
+
+typedef void (*reactor_callback)(int sock, int events, void *arg);
+
+typedef struct {
+  int sock;  // -1 if the slot is free
+  int events;
+  reactor_callback callback;
+  void *arg;
+} reactorEntry;
+
+/**
+ * @brief One task waiting on many lwIP sockets with select(), and calling
+ * back a handler when one of them is ready. Readiness is level-triggered:
+ * a read handler must consume the pending data or it gets called again.
+ * Handlers run on the reactor task and must not block.
+ */
+class SocketReactor {
+ public:
+  static SocketReactor &instance();
+
+  bool add(int sock, int events, reactor_callback callback, void *arg = NULL);
+  bool modify(int sock, int events);
+  void remove(int sock);
+
+ private:
+  SocketReactor();
+  ~SocketReactor();
+  bool start(void);
+  void wakeup(void);
+  void run(void);
+  void dropInvalid(void);
+  static void task(void *arg);
+
+  static SocketReactor *_instance;
+  static portMUX_TYPE _instanceLock;
+  reactorEntry _entries[REACTOR_MAX_SOCKETS];
+  SemaphoreHandle_t _mutex = NULL;
+  TaskHandle_t _task = NULL;
+  int _wakeSock = -1;  // loopback socket used to interrupt select()
+  struct sockaddr_in _wakeAddr;
+};
+
+#endif  // __SOCKETREACTOR_H_
@@ -35,22 +35,182 @@
 #include "lwip/dns.h"
 #include "esp_log.h"
 #include "TCPClient.h"
+#include <algorithm>
 
 static const char *TAG = "TCPClient";
 
-TCPClient::TCPClient() {}
+/**
+ * @brief Construct a new TCPClient
+ *
+ * @param rxSize receive buffer size (allocated on the heap): a few hundred
+ * bytes are enough for short request/response exchanges, bulk transfers
+ * and long lines need more. readLine() returns lines longer than that in
+ * pieces.
+ */
+TCPClient::TCPClient(size_t rxSize) {
+  _rxBuffer = (uint8_t *)malloc(rxSize + 1);
+  if (!_rxBuffer) {
+    ESP_LOGE(TAG, "Could not allocate %d bytes rx buffer", rxSize);
+    return;
+  }
+  _rxSize = rxSize;
+}
 
-TCPClient::~TCPClient() {}
+TCPClient::~TCPClient() {
+  close();
+  free(_rxBuffer);
+  free(_txBuffer);
+  free(_dest_addr);
+}
 
-bool TCPClient::connect(const char *url) {
+bool TCPClient::connect(const char *url, uint32_t timeout) {
   parseUrl(url, _protocol, _hostname, _port, _path);
   if (resolve(_hostname, _ip)) {
-    return connect(_ip, atoi(_port));
+    return connect(_ip, atoi(_port), timeout);
   }
+  _lastError = EHOSTUNREACH;
   return false;
 }
 
-bool TCPClient::connect(IPAddress addr, int port) {
+/**
+ * @brief connect to a host
+ *
+ * @param addr
+ * @param port
+ * @param timeout in ms, the connection is given up after that (0 to block
+ * until lwIP gives up by itself)
+ * @return true
+ * @return false see lastError() for the reason
+ */
+bool TCPClient::connect(IPAddress addr, int port, uint32_t timeout) {
+  if (!openSocket(addr, port)) {
+    return false;
+  }
+
+  int flags = lwip_fcntl(_sock, F_GETFL, 0);
+  if (timeout) {
+    lwip_fcntl(_sock, F_SETFL, flags | O_NONBLOCK);
+  }
+  int err = lwip_connect(_sock, (struct sockaddr *)_dest_addr,
+                         sizeof(struct sockaddr_in));
+  if (err != 0) {
+    _lastError = errno;
+  }
+  if (err != 0 && timeout && _lastError == EINPROGRESS) {
+    // wait for the handshake to complete, fail or time out
+    fd_set writeSet;
+    FD_ZERO(&writeSet);
+    FD_SET(_sock, &writeSet);
+    struct timeval tv = {.tv_sec = (time_t)(timeout / 1000U),
+                         .tv_usec = (suseconds_t)((timeout % 1000U) * 1000U)};
+    int ready = lwip_select(_sock + 1, NULL, &writeSet, NULL, &tv);
+    if (ready == 0) {
+      _lastError = ETIMEDOUT;
+    } else if (ready < 0) {
+      _lastError = errno;
+    } else {
+      socklen_t len = sizeof(_lastError);
+      if (lwip_getsockopt(_sock, SOL_SOCKET, SO_ERROR, &_lastError, &len) <
+          0) {
+        _lastError = errno;
+      }
+    }
+    err = _lastError ? -1 : 0;
+  }
+  if (err != 0) {
+    ESP_LOGE(TAG, "Socket unable to connect to %s:%d: errno %d (%s)",
+             _ip.toChar(), port, _lastError, strerror(_lastError));
+    close();
+    return false;
+  }
+  if (timeout) {
+    lwip_fcntl(_sock, F_SETFL, flags);
+  }
+  statsConnected();
+  ESP_LOGD(TAG, "Successfully connected");
+  return true;
+}
+
+/**
+ * @brief start connecting to a host without waiting for the handshake, for
+ * callers that poll from a loop: connectDone() tells when it's over. Plain
+ * TCP only, TLSClient handshakes block.
+ *
+ * @param addr
+ * @param port
+ * @return true connected or connecting
+ * @return false see lastError() for the reason
+ */
+bool TCPClient::startConnect(IPAddress addr, int port) {
+  if (!openSocket(addr, port)) {
+    return false;
+  }
+  _blockingFlags = lwip_fcntl(_sock, F_GETFL, 0);
+  lwip_fcntl(_sock, F_SETFL, _blockingFlags | O_NONBLOCK);
+  _connecting = true;
+  if (lwip_connect(_sock, (struct sockaddr *)_dest_addr,
+                   sizeof(struct sockaddr_in)) != 0) {
+    _lastError = errno;
+    if (_lastError != EINPROGRESS) {
+      ESP_LOGE(TAG, "Socket unable to connect to %s:%d: errno %d (%s)",
+               _ip.toChar(), port, _lastError, strerror(_lastError));
+      close();
+      return false;
+    }
+    _lastError = 0;
+  }
+  return true;
+}
+
+/**
+ * @brief check, without waiting, on a connection started by startConnect().
+ * The socket is back to blocking mode once connected.
+ *
+ * @return int 1 if connected, 0 if the handshake is still going on, -1 if
+ * it failed (see lastError(), the socket is closed then)
+ */
+int TCPClient::connectDone(void) {
+  if (_sock < 0) {
+    return -1;
+  }
+  if (!_connecting) {
+    return 1;
+  }
+  fd_set writeSet;
+  FD_ZERO(&writeSet);
+  FD_SET(_sock, &writeSet);
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+  int ready = lwip_select(_sock + 1, NULL, &writeSet, NULL, &tv);
+  if (ready == 0) {
+    return 0;
+  }
+  if (ready < 0) {
+    _lastError = errno;
+  } else {
+    socklen_t len = sizeof(_lastError);
+    if (lwip_getsockopt(_sock, SOL_SOCKET, SO_ERROR, &_lastError, &len) < 0) {
+      _lastError = errno;
+    }
+  }
+  if (_lastError) {
+    ESP_LOGE(TAG, "Socket unable to connect to %s:%d: errno %d (%s)",
+             _ip.toChar(), ntohs(_dest_addr->sin_port), _lastError,
+             strerror(_lastError));
+    close();
+    return -1;
+  }
+  lwip_fcntl(_sock, F_SETFL, _blockingFlags);
+  _connecting = false;
+  statsConnected();
+  ESP_LOGD(TAG, "Successfully connected");
+  return 1;
+}
+
+// create the socket for a new connection to addr:port, closing the previous
+// one
+bool TCPClient::openSocket(IPAddress addr, int port) {
+  close();
+  statsStart();
   // struct sockaddr_in6 dest_addr = {0};
   if (!_dest_addr) {
     _dest_addr = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
@@ -73,97 +233,1064 @@ bool TCPClient::connect(IPAddress addr, int port) {
   _ip = addr.toAddr();
   _sock = lwip_socket(_addr_family, SOCK_STREAM, _ip_protocol);
   if (_sock < 0) {
-    ESP_LOGE(TAG, "Unable to create socket: errno %d", _sock);
+    _lastError = errno;
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", _lastError);
     return false;
   }
   ESP_LOGD(TAG, "Socket created, connecting to %s:%d", _ip.toChar(), port);
+  _rxHead = _rxCount = 0;
+  _rxLimit = -1;
+  _txLen = 0;
+  _lastError = 0;
+  if (_noDelay) {
+    setNoDelay(true);
+  }
+  return true;
+}
 
-  int err = lwip_connect(_sock, (struct sockaddr *)_dest_addr,
-                         sizeof(struct sockaddr_in));
-  if (err != 0) {
-    ESP_LOGE(TAG, "Socket unable to connect: errno %d", err);
+/**
+ * @brief take over an already connected socket (e.g. from accept())
+ *
+ * @param sock
+ * @return true
+ * @return false invalid socket
+ */
+bool TCPClient::attach(int sock) {
+  close();
+  if (sock < 0) {
     return false;
   }
-  ESP_LOGD(TAG, "Successfully connected");
+  _sock = sock;
+  statsStart();
+  statsConnected();
+  _rxHead = _rxCount = 0;
+  _rxLimit = -1;
+  _txLen = 0;
+  _lastError = 0;
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  if (lwip_getpeername(_sock, (struct sockaddr *)&peer, &len) == 0) {
+    _ip = (uint32_t)peer.sin_addr.s_addr;
+  }
+  if (_noDelay) {
+    setNoDelay(true);
+  }
   return true;
 }
 
 bool TCPClient::connected(void) { return (_sock >= 0); }
 
+IPAddress TCPClient::remoteIP(void) { return _ip; }
+
+/**
+ * @brief why the last connection attempt failed
+ *
+ * @return int errno value (e.g. ETIMEDOUT, ECONNREFUSED, EHOSTUNREACH), 0 if
+ * it didn't
+ */
+int TCPClient::lastError(void) { return _lastError; }
+
 bool TCPClient::available() {
-  if (_rxPtr < _rxLen) {
+  if (_rxCount) {
+    return true;
+  }
+  return fill() > 0;
+}
+
+/**
+ * @brief wait until data can be read, without spinning
+ *
+ * @param timeout in ms
+ * @return true data is buffered or the socket is readable (which includes
+ * the peer closing the connection)
+ * @return false timeout or error
+ */
+bool TCPClient::waitAvailable(uint32_t timeout) {
+  if (_rxCount || pending() > 0) {
     return true;
   }
-  _rxLen = recv(_sock, _rxBuffer, sizeof(_rxBuffer), 0);
-  _rxPtr = 0;
-  if (_rxLen > 0) {
-    ESP_LOGD(TAG, "rxLen %d bytes from %s:", _rxLen, _ip.toChar());
-    ESP_LOG_BUFFER_HEXDUMP(TAG, _rxBuffer, _rxLen, ESP_LOG_DEBUG);
+  if (_sock < 0) {
+    return false;
   }
-  return (_rxLen > 0);
+  flush();  // a pending request would never get an answer
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(_sock, &readSet);
+  struct timeval tv = {.tv_sec = (time_t)(timeout / 1000U),
+                       .tv_usec = (suseconds_t)((timeout % 1000U) * 1000U)};
+  return lwip_select(_sock + 1, &readSet, NULL, NULL, &tv) > 0;
 }
 
+int TCPClient::fd(void) { return _sock; }
+
 int TCPClient::read(void) {
   if (available()) {
-    return _rxBuffer[_rxPtr++];
+    int c = _rxBuffer[_rxHead];
+    consume(1);
+    return c;
   }
   return -1;
 }
 
 int TCPClient::peek(void) {
   if (available()) {
-    return _rxBuffer[_rxPtr];
+    return _rxBuffer[_rxHead];
   }
   return -1;
 }
 
 int TCPClient::read(uint8_t *rxBuffer, size_t rxLen) {
+  // drain the receive buffer first (in two parts if it wraps)
   size_t len = 0;
-  for (; len < rxLen && available(); len++) {
-    rxBuffer[len] = read();
+  while (len < rxLen && _rxCount) {
+    size_t chunk = min(min(rxLen - len, _rxCount), _rxSize - _rxHead);
+    memcpy(rxBuffer + len, _rxBuffer + _rxHead, chunk);
+    consume(chunk);
+    len += chunk;
+  }
+  // then receive the rest straight into the caller's buffer
+  while (len < rxLen) {
+    int received = receive(rxBuffer + len, rxLen - len);
+    if (received <= 0) {
+      break;
+    }
+    len += received;
   }
   return len;
 }
 
+int TCPClient::read(char *buffer, size_t len) {
+  return read((uint8_t *)buffer, len);
+}
+
 int TCPClient::write(char c) { return write(&c, 1); }
 
 int TCPClient::write(uint8_t *txBuffer, size_t txLen) {
-  int err = lwip_send(_sock, txBuffer, txLen, 0);
-  // ESP_LOG_BUFFER_HEXDUMP(TAG, txBuffer, txLen, ESP_LOG_DEBUG);
-  if (err < 0) {
-    ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+  if (!_txBuffer) {
+    return transmit(txBuffer, txLen);
   }
-  return err;
+  // fill the tx buffer and send it each time it holds a full segment
+  size_t written = 0;
+  while (written < txLen) {
+    if (!_txLen && txLen - written >= _txSize) {
+      // nothing to merge with, send it as is
+      int sent = transmit(txBuffer + written, txLen - written);
+      if (sent < 0) {
+        return written ? written : sent;
+      }
+      return written + sent;
+    }
+    size_t len = min(_txSize - _txLen, txLen - written);
+    memcpy(_txBuffer + _txLen, txBuffer + written, len);
+    _txLen += len;
+    written += len;
+    if (_txLen == _txSize) {
+      // the newest bytes of the buffer are this call's
+      size_t buffered = min(written, _txLen);
+      if (flush() < 0) {
+        // the buffer was dropped: only what went out before counts
+        size_t handed = written - buffered;
+        return handed ? handed : -1;
+      }
+      if (_txLen == _txSize) {
+        break;  // socket full (deadline or non-blocking mode)
+      }
+    }
+  }
+  return written;
+}
+
+/**
+ * @brief send several buffers with a single lwIP call (plus a few more if
+ * the socket takes them partially). Data waiting in the tx buffer goes out
+ * first, in the same call.
+ *
+ * @param iov
+ * @param iovcnt
+ * @return int bytes sent from iov, -1 on error
+ */
+int TCPClient::writev(const struct iovec *iov, int iovcnt) {
+  struct iovec vec[TCP_MAX_IOV];
+  int written = 0;
+  int i = 0;
+  while (i < iovcnt || _txLen) {
+    int count = 0;
+    size_t pending = _txLen;
+    size_t total = pending;
+    if (pending) {
+      vec[count].iov_base = _txBuffer;
+      vec[count++].iov_len = pending;
+    }
+    for (; i < iovcnt && count < TCP_MAX_IOV; i++) {
+      if (iov[i].iov_len) {
+        total += iov[i].iov_len;
+        vec[count++] = iov[i];
+      }
+    }
+    if (!count) {
+      break;
+    }
+    int sent = transmitv(vec, count);
+    if (sent < 0) {
+      _txLen = 0;
+      return written ? written : sent;
+    }
+    if ((size_t)sent < pending) {
+      // keep what's left of the tx buffer for later
+      memmove(_txBuffer, _txBuffer + sent, pending - sent);
+      _txLen = pending - sent;
+      return written;
+    }
+    _txLen = 0;
+    written += sent - pending;
+    if ((size_t)sent < total) {
+      break;  // deadline or non-blocking mode
+    }
+  }
+  return written;
+}
+
+/**
+ * @brief send whatever is waiting in the tx buffer
+ *
+ * @return int bytes sent, -1 on error (buffered data is then dropped). In
+ * deadline or non-blocking mode, what could not be sent stays buffered.
+ */
+int TCPClient::flush(void) {
+  if (!_txLen) {
+    return 0;
+  }
+  int sent = transmit(_txBuffer, _txLen);
+  if (sent < 0) {
+    _txLen = 0;
+    return sent;
+  }
+  if ((size_t)sent < _txLen) {
+    memmove(_txBuffer, _txBuffer + sent, _txLen - sent);
+  }
+  _txLen -= sent;
+  return sent;
+}
+
+/**
+ * @brief merge small writes into full segments, until flush() is called or
+ * the client needs to read
+ *
+ * @param size buffer size, 0 to write straight to the socket
+ * @return true
+ * @return false out of memory
+ */
+bool TCPClient::setTxBuffering(size_t size) {
+  flush();
+  free(_txBuffer);
+  _txBuffer = NULL;
+  _txSize = 0;
+  if (!size) {
+    return true;
+  }
+  _txBuffer = (uint8_t *)malloc(size);
+  if (!_txBuffer) {
+    ESP_LOGE(TAG, "Could not allocate %d bytes tx buffer", size);
+    return false;
+  }
+  _txSize = size;
+  return true;
+}
+
+/**
+ * @brief enable/disable Nagle's algorithm (kept across reconnections)
+ *
+ * @param noDelay true to send segments right away
+ * @return true
+ * @return false
+ */
+bool TCPClient::setNoDelay(bool noDelay) {
+  _noDelay = noDelay;
+  if (_sock < 0) {
+    return true;
+  }
+  int flag = noDelay ? 1 : 0;
+  if (lwip_setsockopt(_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) <
+      0) {
+    ESP_LOGD(TAG, "could not set TCP_NODELAY: %d", errno);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief choose what write(), writev() and flush() do when the socket send
+ * buffer is full
+ *
+ * @param mode TCP_WRITE_BLOCKING waits as long as it takes,
+ * TCP_WRITE_DEADLINE gives up after timeout ms, TCP_WRITE_NONBLOCKING never
+ * waits. The last two return the number of bytes actually taken (see
+ * availableForWrite()), and lastError() tells ETIMEDOUT or EWOULDBLOCK.
+ * @param timeout in ms, for TCP_WRITE_DEADLINE
+ * @return true
+ * @return false mode not supported
+ */
+bool TCPClient::setWriteMode(tcpWriteMode mode, uint32_t timeout) {
+  _writeMode = mode;
+  _writeTimeout = timeout;
+  return true;
+}
+
+/**
+ * @brief how many bytes can be written right now without waiting. This is
+ * a lower bound: lwIP only reports the socket writable when at least
+ * TCP_SNDLOWAT bytes are free in its send buffer.
+ *
+ * @return int free space in the tx buffer plus the socket
+ */
+int TCPClient::availableForWrite(void) {
+  if (_sock < 0) {
+    return 0;
+  }
+  int space = _txBuffer ? _txSize - _txLen : 0;
+  fd_set writeSet;
+  FD_ZERO(&writeSet);
+  FD_SET(_sock, &writeSet);
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+  if (lwip_select(_sock + 1, NULL, &writeSet, NULL, &tv) > 0) {
+    space += TCP_SNDLOWAT;
+  }
+  return space;
+}
+
+// the socket can't take more: wait for room, unless the write mode says not
+// to (or the deadline counted from start has passed)
+bool TCPClient::waitWritable(unsigned long start) {
+  if (_writeMode == TCP_WRITE_NONBLOCKING) {
+    _lastError = EWOULDBLOCK;
+    return false;
+  }
+  unsigned long elapsed = millis() - start;
+  if (elapsed >= _writeTimeout) {
+    _lastError = ETIMEDOUT;
+    return false;
+  }
+  uint32_t remaining = _writeTimeout - elapsed;
+  fd_set writeSet;
+  FD_ZERO(&writeSet);
+  FD_SET(_sock, &writeSet);
+  struct timeval tv = {.tv_sec = (time_t)(remaining / 1000U),
+                       .tv_usec = (suseconds_t)((remaining % 1000U) * 1000U)};
+  lwip_select(_sock + 1, NULL, &writeSet, NULL, &tv);
+  return true;  // send again, it tells if there's room
+}
+
+int TCPClient::receive(uint8_t *buffer, size_t len) {
+  flush();
+  if (_rxLimit == 0) {
+    return 0;  // end of the current message
+  }
+  if (_rxLimit > 0) {
+    len = min(len, (size_t)_rxLimit);
+  }
+  int received = socketRead(buffer, len);
+  statsReceived(received);
+  if (received > 0) {
+    if (_rxLimit > 0) {
+      _rxLimit -= received;
+    }
+    ESP_LOGD(TAG, "rxLen %d bytes from %s:", received, _ip.toChar());
+    ESP_LOG_BUFFER_HEXDUMP(TAG, buffer, received, ESP_LOG_DEBUG);
+  }
+  return received;
+}
+
+int TCPClient::transmit(const uint8_t *buffer, size_t len) {
+  size_t sent = 0;
+  unsigned long start = millis();
+  while (sent < len) {
+    int err = socketWrite(buffer + sent, len - sent);
+    statsSent(err);
+    // ESP_LOG_BUFFER_HEXDUMP(TAG, buffer + sent, len - sent, ESP_LOG_DEBUG);
+    if (err < 0 && _writeMode != TCP_WRITE_BLOCKING &&
+        (errno == EWOULDBLOCK || errno == EAGAIN)) {
+      if (waitWritable(start)) {
+        continue;
+      }
+      break;
+    }
+    if (err < 0) {
+      ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+      return sent ? sent : err;
+    }
+    sent += err;
+  }
+  return sent;
+}
+
+int TCPClient::socketRead(uint8_t *buffer, size_t len) {
+  return lwip_recv(_sock, buffer, len, 0);
+}
+
+int TCPClient::socketWrite(const uint8_t *buffer, size_t len) {
+  int flags = (_writeMode == TCP_WRITE_BLOCKING) ? 0 : MSG_DONTWAIT;
+  return lwip_send(_sock, buffer, len, flags);
+}
+
+// bytes the transport has already decoded but select() can't see
+int TCPClient::pending(void) { return 0; }
+
+int TCPClient::transmitv(struct iovec *iov, int iovcnt) {
+  size_t sent = 0;
+  unsigned long start = millis();
+  int flags = (_writeMode == TCP_WRITE_BLOCKING) ? 0 : MSG_DONTWAIT;
+  while (iovcnt > 0) {
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    int err = lwip_sendmsg(_sock, &msg, flags);
+    statsSent(err);
+    if (err < 0 && flags && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+      if (waitWritable(start)) {
+        continue;
+      }
+      break;
+    }
+    if (err < 0) {
+      ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+      return sent ? sent : err;
+    }
+    sent += err;
+    // skip what went out, it may stop in the middle of a buffer
+    size_t done = err;
+    while (iovcnt && done >= iov->iov_len) {
+      done -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt) {
+      iov->iov_base = (uint8_t *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return sent;
 }
 
 int TCPClient::write(char *buffer, size_t len) {
   return write((uint8_t *)buffer, len);
 }
 
+// frames must be described well enough to be found: 1 to 4 length bytes, a
+// callback for custom framing
+static bool validFraming(const tcpFraming &framing) {
+  switch (framing.type) {
+    case TCP_FRAME_LENGTH:
+      return framing.lengthBytes >= 1 && framing.lengthBytes <= 4;
+    case TCP_FRAME_DELIMITER:
+    case TCP_FRAME_HTTP:
+      return true;
+    case TCP_FRAME_CUSTOM:
+      return framing.callback != NULL;
+  }
+  return false;
+}
+
+// value of a hex digit, -1 if c isn't one
+static int hexDigit(uint8_t c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  c |= 0x20;  // lower case
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// end of a chunked body starting at data[start]: the chunks, the last
+// (empty) one and the trailer. 0 if more data is needed
+static int chunkedLength(const uint8_t *data, size_t len, size_t start) {
+  size_t pos = start;
+  while (true) {
+    const uint8_t *eol =
+        (const uint8_t *)memchr(data + pos, '\n', len - pos);
+    if (!eol) {
+      return 0;
+    }
+    // chunk size in hex, maybe followed by extensions, nothing else
+    const uint8_t *p = data + pos;
+    unsigned long size = 0;
+    int digit;
+    while (p < eol && (digit = hexDigit(*p)) >= 0) {
+      size = size * 16 + digit;
+      if (size > INT32_MAX - len) {
+        return -1;
+      }
+      p++;
+    }
+    if (p == data + pos || (p < eol && *p != ';' && *p != '\r')) {
+      return -1;
+    }
+    pos = eol - data + 1;
+    if (!size) {
+      break;
+    }
+    pos += size;
+    if (pos + 2 > len) {
+      return 0;
+    }
+    if (data[pos] != '\r' || data[pos + 1] != '\n') {
+      return -1;  // the data must be followed by CRLF
+    }
+    pos += 2;
+  }
+  // trailer fields, up to an empty line
+  while (true) {
+    const uint8_t *eol =
+        (const uint8_t *)memchr(data + pos, '\n', len - pos);
+    if (!eol) {
+      return 0;
+    }
+    size_t lineLen = eol - (data + pos);
+    pos = eol - data + 1;
+    if (lineLen == 0 || (lineLen == 1 && eol[-1] == '\r')) {
+      return pos;
+    }
+  }
+}
+
+/**
+ * @brief send a request and wait for (the start of) the response
+ *
+ * @param txBuffer
+ * @param txLen
+ * @param rxBuffer
+ * @param rxLen in: rxBuffer size, out: bytes received
+ * @param timeout in ms, for the whole exchange (0 to wait forever)
+ * @return int bytes received, -1 on error or timeout (see lastError). With
+ * no framing this returns whatever has arrived once the first bytes are in,
+ * use the framed version to get complete responses.
+ */
 int TCPClient::sendAndReceive(uint8_t *txBuffer, size_t txLen,
                               uint8_t *rxBuffer, size_t &rxLen,
                               uint32_t timeout) {
-  write(txBuffer, txLen);
-  return read(rxBuffer, rxLen);
+  unsigned long start = millis();
+  size_t size = rxLen;
+  rxLen = 0;
+  int sent = write(txBuffer, txLen);
+  if (sent < (int)txLen) {
+    _lastError = sent < 0 ? errno : EAGAIN;
+    return -1;
+  }
+  if (!_rxCount) {
+    if (!waitReadable(start, timeout)) {
+      return -1;
+    }
+    int received = fill();
+    if (received <= 0) {
+      _lastError = received < 0 ? errno : ECONNRESET;
+      return -1;
+    }
+  }
+  rxLen = read(rxBuffer, min(size, _rxCount));
+  return rxLen;
+}
+
+/**
+ * @brief send a request and receive exactly one framed response
+ *
+ * @param txBuffer
+ * @param txLen
+ * @param rxBuffer
+ * @param rxLen in: rxBuffer size, out: response length
+ * @param framing
+ * @param timeout in ms, for the whole exchange (0 to wait forever)
+ * @return int response length, -1 on error or timeout (see lastError)
+ */
+int TCPClient::sendAndReceive(uint8_t *txBuffer, size_t txLen,
+                              uint8_t *rxBuffer, size_t &rxLen,
+                              const tcpFraming &framing, uint32_t timeout) {
+  unsigned long start = millis();
+  size_t size = rxLen;
+  rxLen = 0;
+  if (!validFraming(framing)) {
+    _lastError = EINVAL;
+    return -1;
+  }
+  int sent = write(txBuffer, txLen);
+  if (sent < (int)txLen) {
+    _lastError = sent < 0 ? errno : EAGAIN;
+    return -1;
+  }
+  int len = receiveFrame(rxBuffer, size, framing, start, timeout);
+  if (len > 0) {
+    rxLen = len;
+  }
+  return len;
+}
+
+/**
+ * @brief send several requests at once, then collect their responses, so a
+ * batch costs one round trip instead of one per request
+ *
+ * @param requests
+ * @param responses in: one buffer per request, out: iov_len is set to each
+ * response length
+ * @param count
+ * @param framing
+ * @param timeout in ms, for the whole batch (0 to wait forever)
+ * @return int responses received (fewer than count on error or timeout, see
+ * lastError), -1 if the requests could not be sent
+ */
+int TCPClient::pipeline(const struct iovec *requests, struct iovec *responses,
+                        int count, const tcpFraming &framing,
+                        uint32_t timeout) {
+  unsigned long start = millis();
+  if (!validFraming(framing)) {
+    _lastError = EINVAL;
+    return -1;
+  }
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += requests[i].iov_len;
+  }
+  int sent = writev(requests, count);
+  if (sent < (int)total) {
+    _lastError = sent < 0 ? errno : EAGAIN;
+    return -1;
+  }
+  int i;
+  for (i = 0; i < count; i++) {
+    int len = receiveFrame((uint8_t *)responses[i].iov_base,
+                           responses[i].iov_len, framing, start, timeout);
+    if (len < 0) {
+      break;
+    }
+    responses[i].iov_len = len;
+  }
+  return i;
+}
+
+/**
+ * @brief receive one complete frame
+ *
+ * @param buffer
+ * @param len buffer size. A longer frame is dropped (EMSGSIZE), so the next
+ * one can still be read.
+ * @param framing
+ * @param timeout in ms (0 to wait forever)
+ * @return int frame length, as received (length prefix, delimiter or HTTP
+ * headers included), -1 on error or timeout (see lastError)
+ */
+int TCPClient::readFrame(uint8_t *buffer, size_t len,
+                         const tcpFraming &framing, uint32_t timeout) {
+  return receiveFrame(buffer, len, framing, millis(), timeout);
+}
+
+static int frameLength(const tcpFraming &framing, const uint8_t *data,
+                       size_t len) {
+  switch (framing.type) {
+    case TCP_FRAME_LENGTH: {
+      if (len < framing.lengthBytes) {
+        return 0;
+      }
+      uint32_t payload = 0;
+      for (int i = 0; i < framing.lengthBytes; i++) {
+        payload = (payload << 8) | data[i];
+      }
+      if (payload > INT32_MAX - framing.lengthBytes) {
+        return -1;
+      }
+      return framing.lengthBytes + payload;
+    }
+    case TCP_FRAME_DELIMITER: {
+      const uint8_t *end =
+          (const uint8_t *)memchr(data, framing.delimiter, len);
+      return end ? end - data + 1 : 0;
+    }
+    case TCP_FRAME_HTTP: {
+      size_t headers = 0;
+      for (size_t i = 3; i < len; i++) {
+        if (data[i] == '\n' && data[i - 1] == '\r' && data[i - 2] == '\n' &&
+            data[i - 3] == '\r') {
+          headers = i + 1;
+          break;
+        }
+      }
+      if (!headers) {
+        return 0;
+      }
+      // no Content-Length: no body (HEAD, 204, 304...)
+      uint32_t body = 0;
+      bool chunked = false;
+      const char *line = (const char *)data;
+      const char *end = (const char *)data + headers;
+      while (line < end) {
+        const char *next = (const char *)memchr(line, '\n', end - line);
+        next = next ? next + 1 : end;
+        if (next - line > 15 && !strncasecmp(line, "Content-Length:", 15)) {
+          body = strtoul(line + 15, NULL, 10);
+        } else if (next - line > 18 &&
+                   !strncasecmp(line, "Transfer-Encoding:", 18)) {
+          for (const char *c = line + 18; c + 7 <= next; c++) {
+            if (!strncasecmp(c, "chunked", 7)) {
+              chunked = true;
+              break;
+            }
+          }
+          if (!chunked) {
+            return -1;  // delimited by the peer closing, can't be framed
+          }
+        }
+        line = next;
+      }
+      if (chunked) {
+        // the frame includes the chunk sizes, as received
+        return chunkedLength(data, len, headers);
+      }
+      if (body > INT32_MAX - headers) {
+        return -1;
+      }
+      return headers + body;
+    }
+    case TCP_FRAME_CUSTOM:
+      return framing.callback(data, len, framing.arg);
+  }
+  return -1;
+}
+
+// find where the next frame ends, then copy it out (it doesn't have to fit
+// the receive buffer, its header or delimited frame does)
+int TCPClient::receiveFrame(uint8_t *buffer, size_t len,
+                            const tcpFraming &framing, unsigned long start,
+                            uint32_t timeout) {
+  if (!validFraming(framing)) {
+    _lastError = EINVAL;
+    return -1;
+  }
+  int frame = 0;
+  while (true) {
+    if (_rxCount) {
+      // frame lengths are found on contiguous data
+      if (_rxHead + _rxCount > _rxSize) {
+        linearize();
+      }
+      frame = frameLength(framing, _rxBuffer + _rxHead, _rxCount);
+      if (frame < 0) {
+        _lastError = EBADMSG;
+        return -1;
+      }
+      if (frame) {
+        break;
+      }
+      if (_rxCount == _rxSize) {
+        ESP_LOGE(TAG, "Frame header larger than the %d bytes rx buffer",
+                 _rxSize);
+        _lastError = EMSGSIZE;
+        return -1;
+      }
+      if (_rxHead + _rxCount == _rxSize) {
+        linearize();  // so the next bytes don't wrap
+      }
+    }
+    if (!waitReadable(start, timeout)) {
+      return -1;
+    }
+    int received = fill();
+    if (received <= 0) {
+      _lastError = received < 0 ? errno : ECONNRESET;
+      return -1;
+    }
+  }
+
+  size_t copied = 0;
+  while (copied < (size_t)frame) {
+    if (!_rxCount) {
+      if (!waitReadable(start, timeout)) {
+        return -1;
+      }
+      int received = fill();
+      if (received <= 0) {
+        _lastError = received < 0 ? errno : ECONNRESET;
+        return -1;
+      }
+      continue;
+    }
+    size_t chunk = min(min(_rxCount, _rxSize - _rxHead), frame - copied);
+    if (copied < len) {
+      memcpy(buffer + copied, _rxBuffer + _rxHead, min(chunk, len - copied));
+    }
+    consume(chunk);
+    copied += chunk;
+  }
+  if ((size_t)frame > len) {
+    ESP_LOGE(TAG, "Dropped a %d bytes frame, buffer is %d bytes", frame, len);
+    _lastError = EMSGSIZE;
+    return -1;
+  }
+  return frame;
+}
+
+/**
+ * @brief check, without waiting, whether the next frame has been received
+ * entirely: whatever the socket has is buffered, nothing blocks. For callers
+ * polling from a loop, the frame is then read with readFrame() or
+ * readLine() without waiting either.
+ *
+ * @param framing
+ * @return int frame length once it is all in the receive buffer, 0 if more
+ * data is needed, -1 on error, if the peer closed or if the frame doesn't
+ * fit the receive buffer (EMSGSIZE, see lastError)
+ */
+int TCPClient::frameAvailable(const tcpFraming &framing) {
+  if (!validFraming(framing)) {
+    _lastError = EINVAL;
+    return -1;
+  }
+  while (true) {
+    if (_rxCount) {
+      if (_rxHead + _rxCount > _rxSize) {
+        linearize();
+      }
+      int frame = frameLength(framing, _rxBuffer + _rxHead, _rxCount);
+      if (frame < 0) {
+        _lastError = EBADMSG;
+        return -1;
+      }
+      if (frame && (size_t)frame <= _rxCount) {
+        return frame;
+      }
+      if ((size_t)frame > _rxSize || _rxCount == _rxSize) {
+        _lastError = EMSGSIZE;
+        return -1;
+      }
+      if (_rxHead + _rxCount == _rxSize) {
+        linearize();  // so the next bytes don't wrap
+      }
+    }
+    int ready = readableNow();
+    if (ready <= 0) {
+      return ready;
+    }
+    int received = fill();
+    if (received <= 0) {
+      _lastError = received < 0 ? errno : ECONNRESET;
+      return -1;
+    }
+  }
+}
+
+// can more data be received right now? 1 if so, 0 if it would wait, -1 on
+// error (see lastError)
+int TCPClient::readableNow(void) {
+  if (pending() > 0) {
+    return 1;
+  }
+  if (_sock < 0) {
+    _lastError = ENOTCONN;
+    return -1;
+  }
+  flush();  // a pending request would never get an answer
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(_sock, &readSet);
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+  int ready = lwip_select(_sock + 1, &readSet, NULL, NULL, &tv);
+  if (ready < 0) {
+    _lastError = errno;
+    return -1;
+  }
+  return ready > 0;
+}
+
+// wait for more data until the deadline, even if some is already buffered
+bool TCPClient::waitReadable(unsigned long start, uint32_t timeout) {
+  if (pending() > 0) {
+    return true;
+  }
+  if (_sock < 0) {
+    _lastError = ENOTCONN;
+    return false;
+  }
+  flush();  // pending requests would never get an answer
+  struct timeval tv;
+  if (timeout) {
+    unsigned long elapsed = millis() - start;
+    if (elapsed >= timeout) {
+      _lastError = ETIMEDOUT;
+      return false;
+    }
+    unsigned long remaining = timeout - elapsed;
+    tv.tv_sec = remaining / 1000U;
+    tv.tv_usec = (remaining % 1000U) * 1000U;
+  }
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(_sock, &readSet);
+  int ready = lwip_select(_sock + 1, &readSet, NULL, NULL, timeout ? &tv : NULL);
+  if (ready == 0) {
+    _lastError = ETIMEDOUT;
+  } else if (ready < 0) {
+    _lastError = errno;
+  }
+  return ready > 0;
 }
 
 void TCPClient::close(void) {
   if (_sock != -1) {
+    flush();
+    statsClosed();
     lwip_shutdown(_sock, 0);
     lwip_close(_sock);
     ESP_LOGD(TAG, "Socket shutdown");
     _sock = -1;
   }
+  _connecting = false;
+}
+
+/**
+ * @brief snapshot of the connection counters (reset on connect/attach)
+ *
+ * @param stats
+ * @return true
+ * @return false statistics not compiled in (CONFIG_ESP_COMM_TCP_STATS)
+ */
+bool TCPClient::getStats(tcpStats &stats) {
+#ifdef CONFIG_ESP_COMM_TCP_STATS
+  stats = _stats;
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifdef CONFIG_ESP_COMM_TCP_STATS
+void TCPClient::statsStart(void) {
+  _stats = {};
+  _statsStart = micros();
+  _connectedAt = 0;
+  _rttStart = 0;
+}
+
+void TCPClient::statsConnected(void) {
+  _connectedAt = micros();
+  _stats.connectUs = _connectedAt - _statsStart;
+}
+
+void TCPClient::statsSent(int len) {
+  _stats.sendCalls++;
+  if (len <= 0) {
+    return;
+  }
+  _stats.bytesOut += len;
+  if (!_rttStart) {
+    _rttStart = micros();  // a new request, timed until the reply
+  }
+}
+
+void TCPClient::statsReceived(int len) {
+  _stats.recvCalls++;
+  if (len <= 0) {
+    return;
+  }
+  unsigned long now = micros();
+  if (!_stats.bytesIn) {
+    _stats.firstByteUs = now - _connectedAt;
+  }
+  _stats.bytesIn += len;
+  if (_rttStart) {
+    // smoothed like TCP's SRTT (RFC 6298, alpha = 1/8)
+    uint32_t sample = now - _rttStart;
+    if (_stats.rttSamples++) {
+      _stats.rttUs += ((int32_t)sample - (int32_t)_stats.rttUs) / 8;
+    } else {
+      _stats.rttUs = sample;
+    }
+    _rttStart = 0;
+  }
+}
+
+void TCPClient::statsClosed(void) {
+  ESP_LOGD(TAG,
+           "%s: in %lu bytes/%lu calls, out %lu bytes/%lu calls, connect %lu "
+           "us, first byte %lu us, rtt %lu us (%lu samples)",
+           _ip.toChar(), (unsigned long)_stats.bytesIn,
+           (unsigned long)_stats.recvCalls, (unsigned long)_stats.bytesOut,
+           (unsigned long)_stats.sendCalls, (unsigned long)_stats.connectUs,
+           (unsigned long)_stats.firstByteUs, (unsigned long)_stats.rttUs,
+           (unsigned long)_stats.rttSamples);
 }
+#endif
 
-void TCPClient::printf(const char *f, ...) {
+/**
+ * @brief formatted output, written straight into the tx buffer when tx
+ * buffering is on (see setTxBuffering), with no size limit
+ *
+ * @param fmt
+ * @param ...
+ * @return int bytes written, -1 on error
+ */
+int TCPClient::printf(const char *fmt, ...) {
   va_list args;
-  va_start(args, f);
-  char buffer[1024];
+  va_start(args, fmt);
+  int len = vprintf(fmt, args);
   va_end(args);
-  sprintf(buffer, f, args);
-  ESP_LOG_BUFFER_HEXDUMP(TAG, buffer, strlen(buffer), ESP_LOG_DEBUG);
-  write(buffer, strlen(buffer));
+  return len;
+}
+
+static ssize_t streamWrite(void *cookie, const char *buffer, size_t len) {
+  return ((TCPClient *)cookie)->write((uint8_t *)buffer, len);
+}
+
+int TCPClient::vprintf(const char *fmt, va_list args) {
+  va_list copy;
+  if (_txBuffer) {
+    // format in place, after what's already buffered
+    if (_txLen == _txSize && flush() < 0) {
+      return -1;
+    }
+    size_t space = _txSize - _txLen;
+    va_copy(copy, args);
+    int len = vsnprintf((char *)_txBuffer + _txLen, space, fmt, copy);
+    va_end(copy);
+    if (len < 0) {
+      return -1;
+    }
+    if ((size_t)len < space) {
+      _txLen += len;
+      return len;
+    }
+    if ((size_t)len < _txSize && flush() >= 0 && !_txLen) {
+      // fits once the buffer is sent: format it again from the start
+      va_copy(copy, args);
+      vsnprintf((char *)_txBuffer, _txSize, fmt, copy);
+      va_end(copy);
+      _txLen = len;
+      return len;
+    }
+  } else {
+    char chunk[TCP_PRINTF_CHUNK];
+    va_copy(copy, args);
+    int len = vsnprintf(chunk, sizeof(chunk), fmt, copy);
+    va_end(copy);
+    if (len < 0) {
+      return -1;
+    }
+    if ((size_t)len < sizeof(chunk)) {
+      return write((uint8_t *)chunk, len);
+    }
+  }
+
+  // too long for the buffer: stream it through write(), chunk by chunk
+  cookie_io_functions_t functions = {NULL, streamWrite, NULL, NULL};
+  FILE *stream = fopencookie(this, "w", functions);
+  if (!stream) {
+    return -1;
+  }
+  char chunk[TCP_PRINTF_CHUNK];
+  setvbuf(stream, chunk, _IOFBF, sizeof(chunk));
+  va_copy(copy, args);
+  int len = vfprintf(stream, fmt, copy);
+  va_end(copy);
+  if (fclose(stream) != 0) {
+    return -1;
+  }
+  return len;
 }
 
 std::string TCPClient::readUntil(char until) {
@@ -176,4 +1303,155 @@ std::string TCPClient::readUntil(char until) {
     }
   }
   return str;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief bound the reads to the end of a message of known length (e.g. an
+ * HTTP body), so a kept-alive connection reports end of data there instead
+ * of blocking. Data already buffered counts towards the limit.
+ *
+ * @param len message bytes left to read, -1 to read until the peer closes
+ */
+void TCPClient::setReadLimit(int len) {
+  if (len < 0) {
+    _rxLimit = -1;
+    return;
+  }
+  _rxLimit = max(0, len - (int)_rxCount);
+}
+
+/**
+ * @brief
+ *
+ * @return int message bytes not received yet, 0 once the whole message
+ * is buffered, -1 if there is no limit
+ */
+int TCPClient::readLimit(void) { return _rxLimit; }
+
+/**
+ * @brief read a line without copying it: `line` points into the receive
+ * buffer and stays valid until the next read. The delimiter is replaced by a
+ * '\0' so the line can be used as a C string. A line longer than the receive
+ * buffer is returned in buffer-sized pieces.
+ *
+ * @param line
+ * @param until delimiter
+ * @return int line length (without delimiter), -1 if no more data
+ */
+int TCPClient::readLine(const char *&line, char until) {
+  return nextLine(line, until, true);
+}
+
+/**
+ * @brief readLine() without waiting, for callers polling from a loop: only
+ * what the socket already has is received, and an incomplete line stays
+ * buffered until the rest of it comes in.
+ *
+ * @param line
+ * @param until delimiter
+ * @return int line length (without delimiter), -1 if no complete line is
+ * buffered yet (lastError is EWOULDBLOCK) or if no more data (lastError is 0
+ * at the end of the current message, else why the connection ended)
+ */
+int TCPClient::tryReadLine(const char *&line, char until) {
+  return nextLine(line, until, false);
+}
+
+int TCPClient::nextLine(const char *&line, char until, bool wait) {
+  size_t scanned = 0;
+  while (true) {
+    if (_rxHead + _rxCount > _rxSize) {
+      linearize();  // a line must be contiguous to be returned in place
+    }
+    uint8_t *start = _rxBuffer + _rxHead;
+    uint8_t *end =
+        (uint8_t *)memchr(start + scanned, until, _rxCount - scanned);
+    if (end) {
+      *end = 0;
+      line = (const char *)start;
+      size_t len = end - start;
+      consume(len + 1);
+      return len;
+    }
+    scanned = _rxCount;
+
+    // incomplete line: receive more behind it, moving it to the front first
+    // if it reaches the end of the buffer
+    if (_rxHead && _rxHead + _rxCount == _rxSize) {
+      linearize();
+    }
+    int received = 0;
+    if (_rxCount < _rxSize) {
+      if (!wait && _rxLimit != 0) {
+        int ready = readableNow();
+        if (ready < 0) {
+          return -1;
+        }
+        if (!ready) {
+          _lastError = EWOULDBLOCK;
+          return -1;
+        }
+      }
+      received = fill();
+      if (received < 0) {
+        _lastError = errno;
+      } else if (!received) {
+        _lastError = _rxLimit ? ECONNRESET : 0;
+      }
+    }
+    if (received <= 0) {
+      // buffer full or no more data: return what we have
+      if (!_rxCount) {
+        return -1;
+      }
+      start = _rxBuffer + _rxHead;
+      start[_rxCount] = 0;
+      line = (const char *)start;
+      size_t len = _rxCount;
+      consume(len);
+      return len;
+    }
+  }
+}
+
+// receive into the free space that follows the buffered data (up to the end
+// of the buffer, the next call fills the start)
+int TCPClient::fill(void) {
+  if (!_rxCount) {
+    _rxHead = 0;
+  }
+  size_t tail = _rxHead + _rxCount;
+  size_t len;
+  if (tail < _rxSize) {
+    len = _rxSize - tail;
+  } else {
+    tail -= _rxSize;
+    len = _rxHead - tail;
+  }
+  if (!len) {
+    return 0;
+  }
+  int received = receive(_rxBuffer + tail, len);
+  if (received > 0) {
+    _rxCount += received;
+  }
+  return received;
+}
+
+void TCPClient::consume(size_t len) {
+  _rxHead += len;
+  if (_rxHead >= _rxSize) {
+    _rxHead -= _rxSize;
+  }
+  _rxCount -= len;
+}
+
+// move the buffered data to the start of the buffer, in one piece
+void TCPClient::linearize(void) {
+  if (_rxHead + _rxCount <= _rxSize) {
+    memmove(_rxBuffer, _rxBuffer + _rxHead, _rxCount);
+  } else {
+    std::rotate(_rxBuffer, _rxBuffer + _rxHead, _rxBuffer + _rxSize);
+  }
+  _rxHead = 0;
+}
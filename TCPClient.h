@@ -30,16 +30,69 @@
 
 #include "IPAddress.h"
 #include "utils.h"
+#include <stdarg.h>
 #include <string>
 
+struct iovec;
+
+#define TCP_RX_BUFFER_SIZE 8192  // default, see the constructor
+#define TCP_TX_BUFFER_SIZE CONFIG_LWIP_TCP_MSS  // one full segment
+#define TCP_MAX_IOV 8  // buffers submitted per writev call
+#define TCP_PRINTF_CHUNK 128  // printf output is streamed in chunks of that
+
+typedef enum {
+  TCP_WRITE_BLOCKING = 0,  // wait until everything is sent (default)
+  TCP_WRITE_DEADLINE,      // wait until everything is sent or timeout
+  TCP_WRITE_NONBLOCKING,   // send what fits right now
+} tcpWriteMode;
+
+typedef enum {
+  TCP_FRAME_LENGTH = 0,  // big-endian length prefix, then that many bytes
+  TCP_FRAME_DELIMITER,   // up to and including a delimiter byte
+  TCP_FRAME_HTTP,        // HTTP headers, then Content-Length bytes of body
+                         // or a chunked body
+  TCP_FRAME_CUSTOM,      // see tcp_frame_callback
+} tcpFramingType;
+
+// length of the frame at the start of data once it's known, 0 if more data
+// is needed, -1 if the data can't be framed
+typedef int (*tcp_frame_callback)(const uint8_t *data, size_t len, void *arg);
+
+typedef struct {
+  tcpFramingType type;
+  uint8_t lengthBytes;          // TCP_FRAME_LENGTH: 1 to 4
+  uint8_t delimiter;            // TCP_FRAME_DELIMITER
+  tcp_frame_callback callback;  // TCP_FRAME_CUSTOM
+  void *arg;
+} tcpFraming;
+
+// per-connection counters, see CONFIG_ESP_COMM_TCP_STATS
+typedef struct {
+  uint32_t bytesIn;
+  uint32_t bytesOut;
+  uint32_t recvCalls;
+  uint32_t sendCalls;
+  uint32_t connectUs;    // connection (and TLS handshake) time
+  uint32_t firstByteUs;  // from connected to the first byte received
+  uint32_t rttUs;        // smoothed request/response round trip
+  uint32_t rttSamples;
+} tcpStats;
+
 class TCPClient {
  public:
-  TCPClient();
-  ~TCPClient();
-  bool connect(const char *url);
-  bool connect(IPAddress addr, int port);
+  TCPClient(size_t rxSize = TCP_RX_BUFFER_SIZE);
+  virtual ~TCPClient();
+  virtual bool connect(const char *url, uint32_t timeout = 0);
+  virtual bool connect(IPAddress addr, int port, uint32_t timeout = 0);
+  bool startConnect(IPAddress addr, int port);
+  int connectDone(void);
+  bool attach(int sock);
   bool connected(void);
+  IPAddress remoteIP(void);
+  int lastError(void);
   bool available(void);
+  bool waitAvailable(uint32_t timeout);
+  int fd(void);
   int read(void);
   int peek(void);
   int read(uint8_t *buffer, size_t len);
@@ -47,18 +100,74 @@ class TCPClient {
   int write(char c);
   int write(uint8_t *buffer, size_t len);
   int write(char *buffer, size_t len);
+  int writev(const struct iovec *iov, int iovcnt);
+  int flush(void);
+  bool setTxBuffering(size_t size = TCP_TX_BUFFER_SIZE);
+  bool setNoDelay(bool noDelay);
+  virtual bool setWriteMode(tcpWriteMode mode, uint32_t timeout = 0);
+  int availableForWrite(void);
   int sendAndReceive(uint8_t *txBuffer, size_t txLen, uint8_t *rxBuffer,
                      size_t &rxLen, uint32_t timeout = 30000);
+  int sendAndReceive(uint8_t *txBuffer, size_t txLen, uint8_t *rxBuffer,
+                     size_t &rxLen, const tcpFraming &framing,
+                     uint32_t timeout = 30000);
+  int pipeline(const struct iovec *requests, struct iovec *responses,
+               int count, const tcpFraming &framing, uint32_t timeout = 30000);
+  int readFrame(uint8_t *buffer, size_t len, const tcpFraming &framing,
+                uint32_t timeout = 30000);
+  int frameAvailable(const tcpFraming &framing);
   std::string readUntil(char until);
-  void close(void);
-  void printf(const char *fmt, ...);
+  int readLine(const char *&line, char until = '\n');
+  int tryReadLine(const char *&line, char until = '\n');
+  void setReadLimit(int len);
+  int readLimit(void);
+  virtual void close(void);
+  bool getStats(tcpStats &stats);
+  int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  int vprintf(const char *fmt, va_list args);
+
+ protected:
+  bool openSocket(IPAddress addr, int port);
+  int receive(uint8_t *buffer, size_t len);
+  int fill(void);
+  void consume(size_t len);
+  void linearize(void);
+  int transmit(const uint8_t *buffer, size_t len);
+  virtual int transmitv(struct iovec *iov, int iovcnt);
+  // transport hooks, overridden by TLSClient
+  virtual int socketRead(uint8_t *buffer, size_t len);
+  virtual int socketWrite(const uint8_t *buffer, size_t len);
+  virtual int pending(void);
+  bool waitWritable(unsigned long start);
+  bool waitReadable(unsigned long start, uint32_t timeout);
+  int readableNow(void);
+  int nextLine(const char *&line, char until, bool wait);
+  int receiveFrame(uint8_t *buffer, size_t len, const tcpFraming &framing,
+                   unsigned long start, uint32_t timeout);
+#ifdef CONFIG_ESP_COMM_TCP_STATS
+  void statsStart(void);
+  void statsConnected(void);
+  void statsSent(int len);
+  void statsReceived(int len);
+  void statsClosed(void);
+#else
+  void statsStart(void) {}
+  void statsConnected(void) {}
+  void statsSent(int len) {}
+  void statsReceived(int len) {}
+  void statsClosed(void) {}
+#endif
 
- private:
-  int _sock;
-  struct sockaddr_in *_dest_addr;
-  uint8_t _rxBuffer[8192];
-  int _rxLen = 0;
-  int _rxPtr = 0;
+  int _sock = -1;
+  bool _connecting = false;  // startConnect() handshake not over yet
+  int _blockingFlags = 0;    // socket flags to restore once connected
+  struct sockaddr_in *_dest_addr = NULL;
+  int _lastError = 0;
+  uint8_t *_rxBuffer = NULL;  // ring buffer, +1 byte to terminate lines
+  size_t _rxSize = 0;
+  size_t _rxHead = 0;   // next byte to read
+  size_t _rxCount = 0;  // bytes buffered from _rxHead, may wrap
+  int _rxLimit = -1;  // bytes left to receive for the current message
   IPAddress _ip;
   int _addr_family = 0;
   int _ip_protocol = 0;
@@ -66,6 +175,18 @@ class TCPClient {
   char _path[255];
   char _port[6];
   char _protocol[16];
+  uint8_t *_txBuffer = NULL;  // optional, coalesces small writes
+  size_t _txSize = 0;
+  size_t _txLen = 0;
+  bool _noDelay = false;
+  tcpWriteMode _writeMode = TCP_WRITE_BLOCKING;
+  uint32_t _writeTimeout = 0;
+#ifdef CONFIG_ESP_COMM_TCP_STATS
+  tcpStats _stats = {};
+  unsigned long _statsStart = 0;   // micros() at connect/attach
+  unsigned long _connectedAt = 0;  // micros() once connected
+  unsigned long _rttStart = 0;     // first send of the pending request
+#endif
 };
 
 #endif  // __TCPCLIENT_H_
\ No newline at end of file
@@ -0,0 +1,246 @@
+/**
+ * @file TCPServer.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "TCPServer.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "TCPServer";
+
+typedef struct {
+  TCPServer *server;
+  TCPClient *client;
+} workerParam;
+
+/**
+ * @brief Construct a new TCPServer
+ *
+ * @param rxSize receive buffer size of each worker's TCPClient
+ */
+TCPServer::TCPServer(size_t rxSize) : _rxSize(rxSize) {}
+
+TCPServer::~TCPServer() { stop(); }
+
+/**
+ * @brief listen on a port and start the accept and worker tasks
+ *
+ * @param port
+ * @param handler serves one connection
+ * @param arg passed to the handler
+ * @param workers number of connections served at the same time
+ * @param maxConnections connections served or waiting for a worker, more
+ * are refused
+ * @return true
+ * @return false already running, or socket/task creation failed
+ */
+bool TCPServer::begin(int port, tcp_server_handler handler, void *arg,
+                      int workers, int maxConnections) {
+  if (_running || !handler || workers < 1) {
+    return false;
+  }
+  maxConnections = max(maxConnections, workers);
+
+  _listenSock = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+  if (_listenSock < 0) {
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+    return false;
+  }
+  int opt = 1;
+  lwip_setsockopt(_listenSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (lwip_bind(_listenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      lwip_listen(_listenSock, TCP_SERVER_BACKLOG) < 0) {
+    ESP_LOGE(TAG, "Unable to listen on port %d: errno %d", port, errno);
+    lwip_close(_listenSock);
+    _listenSock = -1;
+    return false;
+  }
+  lwip_fcntl(_listenSock, F_SETFL,
+             lwip_fcntl(_listenSock, F_GETFL, 0) | O_NONBLOCK);
+
+  _port = port;
+  _handler = handler;
+  _arg = arg;
+  _workers = workers;
+  _maxConnections = maxConnections;
+  _queue = xQueueCreate(maxConnections + workers, sizeof(int));
+  _slots = xSemaphoreCreateCounting(maxConnections, maxConnections);
+  _exited = xSemaphoreCreateCounting(workers + 1, 0);
+  _clients = new TCPClient *[workers]();
+  _running = true;
+
+  int started = 0;
+  for (int i = 0; i < workers; i++) {
+    workerParam *param = new workerParam{this, new TCPClient(_rxSize)};
+    _clients[i] = param->client;
+    if (xTaskCreate(workerTask, "tcp_worker", TCP_SERVER_TASK_STACK_SIZE,
+                    param, TCP_SERVER_TASK_PRIORITY, NULL) != pdPASS) {
+      delete param->client;
+      delete param;
+      _clients[i] = NULL;
+      break;
+    }
+    started++;
+  }
+  _workers = started;
+  if (started < workers ||
+      xTaskCreate(acceptTask, "tcp_accept", TCP_SERVER_TASK_STACK_SIZE, this,
+                  TCP_SERVER_TASK_PRIORITY, NULL) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start server tasks");
+    _running = false;  // the accept task isn't there to wait for
+    stop();
+    return false;
+  }
+  ESP_LOGI(TAG, "Listening on port %d (%d workers, %d connections max)", port,
+           workers, maxConnections);
+  return true;
+}
+
+/**
+ * @brief stop accepting connections and end the tasks. Connections being
+ * served or waiting are served first, so this waits for the handlers to
+ * return.
+ */
+void TCPServer::stop(void) {
+  if (!_queue) {
+    return;
+  }
+  if (_running) {
+    _running = false;
+    // the accept task notices within TCP_SERVER_ACCEPT_TIMEOUT_MS. Workers
+    // only exit on quit markers, so this is its exit: once it's gone, no
+    // socket can be queued behind the markers
+    xSemaphoreTake(_exited, portMAX_DELAY);
+  }
+  // the queue has room for every connection slot plus the markers
+  int quit = -1;
+  for (int i = 0; i < _workers; i++) {
+    xQueueSend(_queue, &quit, portMAX_DELAY);
+  }
+  for (int i = 0; i < _workers; i++) {
+    xSemaphoreTake(_exited, portMAX_DELAY);
+  }
+  // workers served everything queued before their marker, but never leak
+  // a socket if one is still there
+  int sock;
+  while (xQueueReceive(_queue, &sock, 0) == pdTRUE) {
+    if (sock >= 0) {
+      lwip_close(sock);
+      xSemaphoreGive(_slots);
+    }
+  }
+  lwip_close(_listenSock);
+  _listenSock = -1;
+  for (int i = 0; i < _workers; i++) {
+    delete _clients[i];
+  }
+  delete[] _clients;
+  _clients = NULL;
+  vQueueDelete(_queue);
+  vSemaphoreDelete(_slots);
+  vSemaphoreDelete(_exited);
+  _queue = NULL;
+  _slots = _exited = NULL;
+  ESP_LOGI(TAG, "Server on port %d stopped", _port);
+}
+
+/**
+ * @brief
+ *
+ * @return int connections being served or waiting for a worker
+ */
+int TCPServer::connections(void) {
+  if (!_slots) {
+    return 0;
+  }
+  return _maxConnections - uxSemaphoreGetCount(_slots);
+}
+
+int TCPServer::port(void) { return _port; }
+
+void TCPServer::acceptLoop(void) {
+  while (_running) {
+    fd_set readSet;
+    FD_ZERO(&readSet);
+    FD_SET(_listenSock, &readSet);
+    struct timeval tv = {.tv_sec = TCP_SERVER_ACCEPT_TIMEOUT_MS / 1000,
+                         .tv_usec = (TCP_SERVER_ACCEPT_TIMEOUT_MS % 1000) *
+                                    1000};
+    if (lwip_select(_listenSock + 1, &readSet, NULL, NULL, &tv) <= 0) {
+      continue;
+    }
+    // take every pending connection, the socket is non-blocking
+    while (_running) {
+      int sock = lwip_accept(_listenSock, NULL, NULL);
+      if (sock < 0) {
+        if (errno != EWOULDBLOCK && errno != EAGAIN) {
+          ESP_LOGE(TAG, "accept failed: errno %d", errno);
+        }
+        break;
+      }
+      if (xSemaphoreTake(_slots, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "Too many connections, refusing one");
+        lwip_close(sock);
+        continue;
+      }
+      // workers use blocking I/O
+      lwip_fcntl(sock, F_SETFL, lwip_fcntl(sock, F_GETFL, 0) & ~O_NONBLOCK);
+      xQueueSend(_queue, &sock, portMAX_DELAY);
+    }
+  }
+}
+
+void TCPServer::serve(TCPClient *client) {
+  int sock;
+  while (xQueueReceive(_queue, &sock, portMAX_DELAY) == pdTRUE && sock >= 0) {
+    client->attach(sock);
+    ESP_LOGD(TAG, "Serving %s", client->remoteIP().toChar());
+    _handler(*client, _arg);
+    client->close();
+    xSemaphoreGive(_slots);
+  }
+}
+
+void TCPServer::acceptTask(void *arg) {
+  TCPServer *server = (TCPServer *)arg;
+  server->acceptLoop();
+  xSemaphoreGive(server->_exited);
+  vTaskDelete(NULL);
+}
+
+void TCPServer::workerTask(void *arg) {
+  workerParam *param = (workerParam *)arg;
+  TCPServer *server = param->server;
+  TCPClient *client = param->client;
+  delete param;
+  server->serve(client);
+  xSemaphoreGive(server->_exited);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,86 @@
+/**
+ * @file TCPServer.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __TCPSERVER_H_
+#define __TCPSERVER_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "TCPClient.h"
+#include "utils.h"
+
+#define TCP_SERVER_WORKERS 2
+#define TCP_SERVER_MAX_CONNECTIONS 4  // served + waiting for a worker
+#define TCP_SERVER_BACKLOG 4
+#define TCP_SERVER_TASK_STACK_SIZE 4096
+#define TCP_SERVER_TASK_PRIORITY 5
+#define TCP_SERVER_ACCEPT_TIMEOUT_MS 1000  // how often stop() is checked
+
+// called on a worker task for each connection, which is closed when it
+// returns
+typedef void (*tcp_server_handler)(TCPClient &client, void *arg);
+
+/**
+ * @brief TCP server: one task accepts connections (non-blocking) and hands
+ * them to a fixed pool of worker tasks, each serving one connection at a
+ * time through its own TCPClient. Connections beyond maxConnections are
+ * closed right away; accepted ones wait in a queue until a worker is free.
+ */
+class TCPServer {
+ public:
+  TCPServer(size_t rxSize = TCP_RX_BUFFER_SIZE);
+  ~TCPServer();
+  bool begin(int port, tcp_server_handler handler, void *arg = NULL,
+             int workers = TCP_SERVER_WORKERS,
+             int maxConnections = TCP_SERVER_MAX_CONNECTIONS);
+  void stop(void);
+  int connections(void);
+  int port(void);
+
+ private:
+  void acceptLoop(void);
+  void serve(TCPClient *client);
+  static void acceptTask(void *arg);
+  static void workerTask(void *arg);
+
+  size_t _rxSize;
+  int _port = 0;
+  int _listenSock = -1;
+  volatile bool _running = false;  // read by the accept task
+  tcp_server_handler _handler = NULL;
+  void *_arg = NULL;
+  int _workers = 0;
+  int _maxConnections = 0;
+  TCPClient **_clients = NULL;  // one per worker
+  QueueHandle_t _queue = NULL;  // accepted sockets, -1 stops a worker
+  SemaphoreHandle_t _slots = NULL;  // free connection slots
+  SemaphoreHandle_t _exited = NULL;  // given by each task when it ends
+};
+
+#endif  // __TCPSERVER_H_
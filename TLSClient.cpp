@@ -0,0 +1,298 @@
+/**
+ * @file TLSClient.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "TLSClient.h"
+#include "Wifi.h"
+#include "esp_crt_bundle.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "TLSClient";
+
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+typedef struct {
+  char host[100];  // empty if the slot is free
+  int port;
+  esp_tls_client_session_t *session;
+  unsigned long lastUsed;
+} tlsSessionEntry;
+
+static tlsSessionEntry sessionCache[TLS_SESSION_CACHE_SIZE];
+static SemaphoreHandle_t sessionMutex = NULL;
+
+static void lockSessions(void) {
+  if (!sessionMutex) {
+    sessionMutex = xSemaphoreCreateMutex();
+  }
+  xSemaphoreTake(sessionMutex, portMAX_DELAY);
+}
+
+static void unlockSessions(void) { xSemaphoreGive(sessionMutex); }
+
+// take the cached session out of the cache: tickets are meant to be used
+// once, and the caller frees it after the handshake
+static esp_tls_client_session_t *takeSession(const char *host, int port) {
+  esp_tls_client_session_t *session = NULL;
+  lockSessions();
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    tlsSessionEntry *entry = &sessionCache[i];
+    if (entry->session && entry->port == port &&
+        !strcmp(entry->host, host)) {
+      session = entry->session;
+      entry->session = NULL;
+      entry->host[0] = 0;
+      break;
+    }
+  }
+  unlockSessions();
+  return session;
+}
+
+// store a session for host:port, replacing the previous one or the least
+// recently used entry
+static void putSession(const char *host, int port,
+                       esp_tls_client_session_t *session) {
+  lockSessions();
+  int slot = -1;
+  for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+    tlsSessionEntry *entry = &sessionCache[i];
+    if (entry->session && entry->port == port &&
+        !strcmp(entry->host, host)) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    slot = 0;
+    for (int i = 0; i < TLS_SESSION_CACHE_SIZE; i++) {
+      if (!sessionCache[i].session) {
+        slot = i;
+        break;
+      }
+      if (sessionCache[i].lastUsed < sessionCache[slot].lastUsed) {
+        slot = i;
+      }
+    }
+  }
+  tlsSessionEntry *entry = &sessionCache[slot];
+  if (entry->session) {
+    esp_tls_free_client_session(entry->session);
+  }
+  strncpy(entry->host, host, sizeof(entry->host) - 1);
+  entry->host[sizeof(entry->host) - 1] = 0;
+  entry->port = port;
+  entry->session = session;
+  entry->lastUsed = millis();
+  unlockSessions();
+}
+#endif
+
+TLSClient::TLSClient(size_t rxSize) : TCPClient(rxSize) {}
+
+TLSClient::~TLSClient() { close(); }
+
+bool TLSClient::connect(const char *url, uint32_t timeout) {
+  parseUrl(url, _protocol, _hostname, _port, _path);
+  return connect(_hostname, atoi(_port), timeout);
+}
+
+bool TLSClient::connect(IPAddress addr, int port, uint32_t timeout) {
+  // the certificate has to be issued for the IP address then
+  return connect(addr.toChar(), port, timeout);
+}
+
+/**
+ * @brief connect and run the TLS handshake, resuming the cached session for
+ * that host if there is one
+ *
+ * @param host name, also used for SNI and certificate verification
+ * @param port
+ * @param timeout in ms, for the connection and the handshake (0 to wait
+ * until lwIP gives up)
+ * @return true
+ * @return false see lastError() for the reason
+ */
+bool TLSClient::connect(const char *host, int port, uint32_t timeout) {
+  close();
+  statsStart();
+  if (host != _hostname) {
+    strncpy(_hostname, host, sizeof(_hostname) - 1);
+    _hostname[sizeof(_hostname) - 1] = 0;
+  }
+  _tlsPort = port;
+  _tls = esp_tls_init();
+  if (!_tls) {
+    _lastError = ENOMEM;
+    return false;
+  }
+
+  esp_tls_cfg_t cfg = {};
+  if (_caCert) {
+    cfg.cacert_buf = (const unsigned char *)_caCert;
+    cfg.cacert_bytes = strlen(_caCert) + 1;
+  } else {
+    cfg.crt_bundle_attach = esp_crt_bundle_attach;
+  }
+  cfg.timeout_ms = timeout;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  cfg.client_session = takeSession(_hostname, port);
+#endif
+
+  bool resuming = false;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  resuming = (cfg.client_session != NULL);
+#endif
+  unsigned long start = millis();
+  int ret = esp_tls_conn_new_sync(_hostname, strlen(_hostname), port, &cfg,
+                                  _tls);
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  if (cfg.client_session) {
+    esp_tls_free_client_session(cfg.client_session);
+  }
+#endif
+  if (ret != 1) {
+    int sysError = 0;
+    esp_tls_error_handle_t errorHandle;
+    if (esp_tls_get_error_handle(_tls, &errorHandle) == ESP_OK) {
+      esp_tls_get_and_clear_error_type(errorHandle, ESP_TLS_ERR_TYPE_SYSTEM,
+                                       &sysError);
+    }
+    _lastError = sysError ? sysError : ECONNABORTED;
+    ESP_LOGE(TAG, "TLS connection to %s:%d failed: errno %d", _hostname, port,
+             _lastError);
+    esp_tls_conn_destroy(_tls);
+    _tls = NULL;
+    return false;
+  }
+  ESP_LOGD(TAG, "TLS connected to %s:%d, handshake took %lu ms%s", _hostname,
+           port, millis() - start,
+           resuming ? " (session resumed)" : "");
+
+  esp_tls_get_conn_sockfd(_tls, &_sock);
+  statsConnected();
+  _rxHead = _rxCount = 0;
+  _rxLimit = -1;
+  _txLen = 0;
+  _lastError = 0;
+  // esp-tls leaves the connection timeout on the socket, reads block as
+  // with TCPClient
+  struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+  lwip_setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  lwip_setsockopt(_sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (_noDelay) {
+    setNoDelay(true);
+  }
+  saveSession();
+  return true;
+}
+
+void TLSClient::close(void) {
+  if (!_tls) {
+    return;
+  }
+  flush();
+  statsClosed();
+  saveSession();  // TLS 1.3 tickets arrive after the handshake
+  esp_tls_conn_destroy(_tls);  // closes the socket too
+  ESP_LOGD(TAG, "TLS connection closed");
+  _tls = NULL;
+  _sock = -1;
+}
+
+/**
+ * @brief verify servers against this CA instead of the certificate bundle
+ *
+ * @param pem CA certificate, must stay valid while the client is used
+ */
+void TLSClient::setCACert(const char *pem) { _caCert = pem; }
+
+// a TLS record that could only be written partly must be written again as
+// is, so writes always block
+bool TLSClient::setWriteMode(tcpWriteMode mode, uint32_t timeout) {
+  return mode == TCP_WRITE_BLOCKING;
+}
+
+void TLSClient::saveSession(void) {
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  esp_tls_client_session_t *session = esp_tls_get_client_session(_tls);
+  if (session) {
+    putSession(_hostname, _tlsPort, session);
+  }
+#endif
+}
+
+// records can't be gathered by the socket, send the buffers one by one
+// (TLS encrypts them anyway)
+int TLSClient::transmitv(struct iovec *iov, int iovcnt) {
+  int sent = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    int len = transmit((const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    if (len < 0) {
+      return sent ? sent : len;
+    }
+    sent += len;
+    if (len < (int)iov[i].iov_len) {
+      break;
+    }
+  }
+  return sent;
+}
+
+int TLSClient::socketRead(uint8_t *buffer, size_t len) {
+  if (!_tls) {
+    return -1;
+  }
+  while (true) {
+    int ret = esp_tls_conn_read(_tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+      continue;  // e.g. a post-handshake message was handled
+    }
+    return ret < 0 ? -1 : ret;
+  }
+}
+
+int TLSClient::socketWrite(const uint8_t *buffer, size_t len) {
+  if (!_tls) {
+    return -1;
+  }
+  while (true) {
+    int ret = esp_tls_conn_write(_tls, buffer, len);
+    if (ret == ESP_TLS_ERR_SSL_WANT_READ || ret == ESP_TLS_ERR_SSL_WANT_WRITE) {
+      continue;
+    }
+    return ret < 0 ? -1 : ret;
+  }
+}
+
+int TLSClient::pending(void) {
+  if (!_tls) {
+    return 0;
+  }
+  return max(0, (int)esp_tls_get_bytes_avail(_tls));
+}
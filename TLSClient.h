@@ -0,0 +1,68 @@
+/**
+ * @file TLSClient.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __TLSCLIENT_H_
+#define __TLSCLIENT_H_
+
+#include "esp_tls.h"
+#include "TCPClient.h"
+
+#define TLS_SESSION_CACHE_SIZE 4  // hosts whose TLS session is kept
+
+/**
+ * @brief TCPClient over TLS (esp-tls/mbedtls). Servers are verified against
+ * the ESP x509 certificate bundle, or against the CA given to setCACert().
+ * With CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS, the session of the last
+ * connection to each host is cached, and reconnecting resumes it instead of
+ * going through a full handshake.
+ */
+class TLSClient : public TCPClient {
+ public:
+  TLSClient(size_t rxSize = TCP_RX_BUFFER_SIZE);
+  ~TLSClient();
+  bool connect(const char *url, uint32_t timeout = 0) override;
+  bool connect(IPAddress addr, int port, uint32_t timeout = 0) override;
+  bool connect(const char *host, int port, uint32_t timeout);
+  void close(void) override;
+  void setCACert(const char *pem);
+  bool setWriteMode(tcpWriteMode mode, uint32_t timeout = 0) override;
+
+ protected:
+  int transmitv(struct iovec *iov, int iovcnt) override;
+  int socketRead(uint8_t *buffer, size_t len) override;
+  int socketWrite(const uint8_t *buffer, size_t len) override;
+  int pending(void) override;
+
+ private:
+  void saveSession(void);
+
+  esp_tls_t *_tls = NULL;
+  const char *_caCert = NULL;
+  int _tlsPort = 0;
+};
+
+#endif  // __TLSCLIENT_H_
@@ -0,0 +1,182 @@
+/**
+ * @file TokenBucket.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "TokenBucket.h"
+#include "esp_log.h"
+#include "esp_rom_sys.h"
+#include "utils.h"
+
+static const char *TAG = "TokenBucket";
+
+/**
+ * @brief
+ *
+ * @param rate in bytes/s, 0 for no limit
+ * @param burst in bytes
+ */
+TokenBucket::TokenBucket(uint32_t rate, uint32_t burst) {
+  _lock = xSemaphoreCreateMutex();
+  _turn = xSemaphoreCreateMutex();
+  _ready = xSemaphoreCreateBinary();
+  esp_timer_create_args_t args = {};
+  args.callback = timerCallback;
+  args.arg = this;
+  args.dispatch_method = ESP_TIMER_TASK;
+  args.name = "pacer";
+  if (!_lock || !_turn || !_ready ||
+      esp_timer_create(&args, &_timer) != ESP_OK) {
+    // pace() doesn't wait then
+    ESP_LOGE(TAG, "Could not create the pacing timer");
+  }
+  setRate(rate, burst);
+}
+
+TokenBucket::~TokenBucket() {
+  if (_timer) {
+    esp_timer_stop(_timer);
+    esp_timer_delete(_timer);
+  }
+  if (_lock) {
+    vSemaphoreDelete(_lock);
+  }
+  if (_turn) {
+    vSemaphoreDelete(_turn);
+  }
+  if (_ready) {
+    vSemaphoreDelete(_ready);
+  }
+}
+
+/**
+ * @brief change the rate, the bucket starts full
+ *
+ * @param rate in bytes/s, 0 for no limit
+ * @param burst in bytes
+ */
+void TokenBucket::setRate(uint32_t rate, uint32_t burst) {
+  if (_lock) {
+    xSemaphoreTake(_lock, portMAX_DELAY);
+  }
+  _rate = rate;
+  _burst = burst;
+  _tokens = (int64_t)burst * 1000000;
+  _lastRefill = esp_timer_get_time();
+  if (_lock) {
+    xSemaphoreGive(_lock);
+  }
+}
+
+/**
+ * @brief take tokens for a packet about to be sent, waiting until there are
+ * enough. Senders queue behind each other in debt: each one waits for the
+ * rate to pay for its packet after those already waiting.
+ *
+ * @param bytes
+ */
+void TokenBucket::pace(size_t bytes) {
+  if (!_lock || !_turn || !_ready || !_timer) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _stats.packets++;
+  _stats.bytes += bytes;
+  if (!_rate) {
+    xSemaphoreGive(_lock);
+    return;
+  }
+  int64_t now = esp_timer_get_time();
+  refill(now);
+  _tokens -= (int64_t)bytes * 1000000;
+  if (_tokens >= 0) {
+    xSemaphoreGive(_lock);
+    return;
+  }
+  int64_t delay = (-_tokens + _rate - 1) / _rate;
+  _stats.delayed++;
+  _stats.delayUs += delay;
+  _stats.maxDelayUs = max(_stats.maxDelayUs, (uint32_t)delay);
+  _stats.queuedBytes += bytes;
+  _stats.maxQueuedBytes = max(_stats.maxQueuedBytes, _stats.queuedBytes);
+  xSemaphoreGive(_lock);
+
+  waitUntil(now + delay);
+
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _stats.queuedBytes -= bytes;
+  xSemaphoreGive(_lock);
+}
+
+void TokenBucket::getStats(tokenBucketStats &stats) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  stats = _stats;
+  xSemaphoreGive(_lock);
+}
+
+// keeps queuedBytes, those senders are still waiting
+void TokenBucket::resetStats(void) {
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  uint32_t queued = _stats.queuedBytes;
+  _stats = {};
+  _stats.queuedBytes = _stats.maxQueuedBytes = queued;
+  xSemaphoreGive(_lock);
+}
+
+// under _lock
+void TokenBucket::refill(int64_t now) {
+  int64_t elapsed = now - _lastRefill;
+  _lastRefill = now;
+  int64_t full = (int64_t)_burst * 1000000;
+  if (_tokens >= full) {
+    return;
+  }
+  // no need to add more than it takes to fill up (and no overflow)
+  if (elapsed > (full - _tokens) / _rate) {
+    _tokens = full;
+  } else {
+    _tokens += elapsed * _rate;
+  }
+}
+
+// vTaskDelay() would round up to the tick (1-10 ms): sleep on a one-shot
+// esp_timer instead, or spin for very short waits
+void TokenBucket::waitUntil(int64_t deadline) {
+  xSemaphoreTake(_turn, portMAX_DELAY);
+  int64_t remaining = deadline - esp_timer_get_time();
+  if (remaining >= TOKEN_BUCKET_SPIN_US) {
+    xSemaphoreTake(_ready, 0);
+    if (esp_timer_start_once(_timer, remaining) == ESP_OK) {
+      xSemaphoreTake(_ready, portMAX_DELAY);
+    }
+  } else if (remaining > 0) {
+    esp_rom_delay_us(remaining);
+  }
+  xSemaphoreGive(_turn);
+}
+
+void TokenBucket::timerCallback(void *arg) {
+  xSemaphoreGive(((TokenBucket *)arg)->_ready);
+}
@@ -0,0 +1,83 @@
+/**
+ * @file TokenBucket.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __TOKENBUCKET_H_
+#define __TOKENBUCKET_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define TOKEN_BUCKET_BURST 4096  // default, bytes sent at once after a pause
+#define TOKEN_BUCKET_SPIN_US 50  // shorter waits spin instead of sleeping
+
+typedef struct {
+  uint32_t packets;
+  uint32_t bytes;
+  uint32_t delayed;      // packets that had to wait
+  uint64_t delayUs;      // total wait
+  uint32_t maxDelayUs;   // longest wait
+  uint32_t queuedBytes;  // waiting right now
+  uint32_t maxQueuedBytes;
+} tokenBucketStats;
+
+/**
+ * @brief paces senders to a rate, letting a burst through at once. Tokens
+ * (bytes) accumulate at the rate up to the burst size; sending takes them,
+ * and a sender finding too few waits until the rate has paid for its
+ * packet, timed with esp_timer to the microsecond. One bucket can be shared
+ * by several senders (see UDPClient::setPacer() and EspNow::setPacer()) to
+ * cap their total.
+ */
+class TokenBucket {
+ public:
+  TokenBucket(uint32_t rate = 0, uint32_t burst = TOKEN_BUCKET_BURST);
+  ~TokenBucket();
+  void setRate(uint32_t rate, uint32_t burst = TOKEN_BUCKET_BURST);
+  void pace(size_t bytes);
+  void getStats(tokenBucketStats &stats);
+  void resetStats(void);
+
+ private:
+  void refill(int64_t now);
+  void waitUntil(int64_t deadline);
+  static void timerCallback(void *arg);
+
+  uint32_t _rate = 0;   // bytes/s, 0 for no limit
+  uint32_t _burst = 0;
+  int64_t _tokens = 0;  // in millionths of a byte, negative when in debt
+  int64_t _lastRefill = 0;  // esp_timer_get_time()
+  tokenBucketStats _stats = {};
+  SemaphoreHandle_t _lock = NULL;
+  SemaphoreHandle_t _turn = NULL;   // one waiter uses the timer at a time
+  SemaphoreHandle_t _ready = NULL;  // given by the timer
+  esp_timer_handle_t _timer = NULL;
+};
+
+#endif  // __TOKENBUCKET_H_
@@ -27,6 +27,8 @@
 
 #include "UDPClient.h"
 #include "IPAddress.h"
+#include "SocketReactor.h"
+#include "TokenBucket.h"
 #include "esp_netif.h"
 #include "lwip/err.h"
 #include "lwip/sockets.h"
@@ -40,7 +42,10 @@ static const char *TAG = "UDPClient";
 
 UDPClient::UDPClient() {}
 
-UDPClient::~UDPClient() { stop(); }
+UDPClient::~UDPClient() {
+  stop();
+  free(_dest_addr);
+}
 
 // bool UDPClient::begin(const char *url) {
 //   if (!strstr(url, "://")) {
@@ -93,13 +98,13 @@ UDPClient::~UDPClient() { stop(); }
 // }
 
 bool UDPClient::begin(IPAddress addr, uint16_t port) {
+  stop();
   // struct sockaddr_in6 dest_addr = {0};
-  _sock = lwip_socket(_addr_family, SOCK_DGRAM, _ip_protocol);
-  if (_sock < 0) {
-    ESP_LOGE(TAG, "Unable to create socket: errno %d", _sock);
+  _addr_family = AF_INET;
+  _ip_protocol = IPPROTO_IP;
+  if (!openSocket()) {
     return false;
   }
-  ESP_LOGD(TAG, "Socket created");
 
   int yes = 1;
   if (lwip_setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0) {
@@ -111,14 +116,11 @@ bool UDPClient::begin(IPAddress addr, uint16_t port) {
   _remoteIp = addr.toAddr();
   _serverPort = port;
 
-  struct sockaddr_in *_src_addr =
-      (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
+  struct sockaddr_in src_addr = {};
   if (addr.type() == ESP_IPADDR_TYPE_V4) {
-    _src_addr->sin_addr.s_addr = htonl(addr.toUInt());
-    _src_addr->sin_family = AF_INET;
-    _src_addr->sin_port = htons(_serverPort);
-    _addr_family = AF_INET;
-    _ip_protocol = IPPROTO_IP;
+    src_addr.sin_addr.s_addr = htonl(addr.toUInt());
+    src_addr.sin_family = AF_INET;
+    src_addr.sin_port = htons(_serverPort);
   } /*  else {
      inet6_aton(addr.ipAddress.u_addr.ip6.addr, &dest_addr.sin6_addr);
      dest_addr.sin6_family = AF_INET6;
@@ -128,13 +130,27 @@ bool UDPClient::begin(IPAddress addr, uint16_t port) {
      ip_protocol = IPPROTO_IPV6;
    } */
 
-  if (lwip_bind(_sock, (struct sockaddr *)_src_addr, sizeof(struct sockaddr)) <
-      0) {
+  if (lwip_bind(_sock, (struct sockaddr *)&src_addr, sizeof(src_addr)) < 0) {
     ESP_LOGD(TAG, "could not bind socket: %d", errno);
     stop();
     return false;
   }
-  fcntl(_sock, F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+// one non-blocking socket, kept until stop()
+bool UDPClient::openSocket(void) {
+  if (_sock >= 0) {
+    return true;
+  }
+  _sock = lwip_socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+  if (_sock < 0) {
+    ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
+    return false;
+  }
+  ESP_LOGD(TAG, "Socket created");
+  lwip_fcntl(_sock, F_SETFL, O_NONBLOCK);
+  _stats = {};
   return true;
 }
 
@@ -142,37 +158,195 @@ bool UDPClient::begin(uint16_t port) { return begin(ipNull, port); }
 
 bool UDPClient::beginMulticast(IPAddress addr, uint16_t port) {
   ESP_LOGD(TAG, "BeginMulticast: %s:%d", addr.toChar(), port);
-  if (begin(ipNull, port)) {
-    ESP_LOGD(TAG, "IP=%s", addr.toChar());
-    if (addr != ipNull) {
-      struct ip_mreq mreq;
-      mreq.imr_multiaddr.s_addr = (in_addr_t)addr.toAddr();
-      mreq.imr_interface.s_addr = ipNull.toAddr();
-      if (setsockopt(_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
-                     sizeof(mreq)) < 0) {
-        ESP_LOGD(TAG, "could not join igmp: %d", errno);
-        stop();
-        return false;
+  if (!begin(ipNull, port)) {
+    return false;
+  }
+  if (addr != ipNull) {
+    if (!joinGroup(addr)) {
+      stop();
+      return false;
+    }
+    _multicastIp = addr;
+  }
+  return true;
+}
+
+/**
+ * @brief receive (and send multicast) on one interface only. Call it after
+ * begin(), groups joined afterwards default to that interface.
+ *
+ * @param netif e.g. the STA or the AP interface, NULL for any
+ * @return true
+ * @return false no socket, or lwIP refused
+ */
+bool UDPClient::bindInterface(esp_netif_t *netif) {
+  if (_sock < 0) {
+    return false;
+  }
+  struct ifreq ifr = {};  // no name unbinds
+  if (netif && esp_netif_get_netif_impl_name(netif, ifr.ifr_name) != ESP_OK) {
+    return false;
+  }
+  if (lwip_setsockopt(_sock, SOL_SOCKET, SO_BINDTODEVICE, &ifr,
+                      sizeof(ifr)) < 0) {
+    ESP_LOGD(TAG, "could not bind to interface %s: %d", ifr.ifr_name, errno);
+    return false;
+  }
+  struct in_addr iface;
+  iface.s_addr = interfaceAddr(netif);
+  if (lwip_setsockopt(_sock, IPPROTO_IP, IP_MULTICAST_IF, &iface,
+                      sizeof(iface)) < 0) {
+    ESP_LOGD(TAG, "could not set the multicast interface: %d", errno);
+    return false;
+  }
+  _netif = netif;
+  return true;
+}
+
+/**
+ * @brief join a multicast group, one socket can be in up to UDP_MAX_GROUPS
+ * (e.g. SSDP, mDNS and an application channel on the same port). stop()
+ * leaves them all.
+ *
+ * @param group
+ * @param netif interface to join on, NULL for the one given to
+ * bindInterface() or the default one
+ * @return true
+ * @return false no socket, too many groups or lwIP refused
+ */
+bool UDPClient::joinGroup(IPAddress group, esp_netif_t *netif) {
+  return joinGroup(group, NULL, 0, netif);
+}
+
+/**
+ * @brief join a multicast group, only accepting datagrams from some
+ * sources. lwIP only speaks IGMPv2, so the sources are filtered here rather
+ * than by the router: this needs CONFIG_LWIP_NETBUF_RECVINFO, to tell which
+ * group a datagram was sent to. Joining a group again replaces its sources.
+ *
+ * @param group
+ * @param sources up to UDP_MAX_SOURCES, NULL for any
+ * @param count
+ * @param netif see joinGroup(IPAddress, esp_netif_t *)
+ * @return true
+ * @return false no socket, too many groups or sources, no
+ * CONFIG_LWIP_NETBUF_RECVINFO, or lwIP refused
+ */
+bool UDPClient::joinGroup(IPAddress group, const IPAddress *sources,
+                          int count, esp_netif_t *netif) {
+  if (_sock < 0 || count < 0 || count > UDP_MAX_SOURCES ||
+      (count && !sources)) {
+    return false;
+  }
+  if (count) {
+#ifdef CONFIG_LWIP_NETBUF_RECVINFO
+    int yes = 1;
+    if (lwip_setsockopt(_sock, IPPROTO_IP, IP_PKTINFO, &yes, sizeof(yes)) <
+        0) {
+      ESP_LOGD(TAG, "could not get packet info: %d", errno);
+      return false;
+    }
+#else
+    ESP_LOGE(TAG, "Source filters need CONFIG_LWIP_NETBUF_RECVINFO");
+    return false;
+#endif
+  }
+  uint32_t addr = group.toAddr();
+  uint32_t iface = interfaceAddr(netif ? netif : _netif);
+  udpGroup *entry = NULL;
+  for (int i = 0; i < UDP_MAX_GROUPS; i++) {
+    udpGroup *g = &_groups[i];
+    if (g->group == addr && g->iface == iface) {
+      entry = g;
+      break;
+    }
+    if (!g->group && !entry) {
+      entry = g;
+    }
+  }
+  if (!entry) {
+    ESP_LOGE(TAG, "Already in %d groups", UDP_MAX_GROUPS);
+    return false;
+  }
+  if (entry->group != addr) {
+    if (!membership(IP_ADD_MEMBERSHIP, addr, iface)) {
+      return false;
+    }
+    entry->group = addr;
+    entry->iface = iface;
+  }
+  entry->sourceCount = count;
+  for (int i = 0; i < count; i++) {
+    IPAddress source = sources[i];  // toAddr() isn't const
+    entry->sources[i] = source.toAddr();
+  }
+  _sourceFilter = _sourceFilter || count;
+  return true;
+}
+
+/**
+ * @brief
+ *
+ * @param group
+ * @param netif as given to joinGroup()
+ * @return true
+ * @return false not in that group
+ */
+bool UDPClient::leaveGroup(IPAddress group, esp_netif_t *netif) {
+  uint32_t addr = group.toAddr();
+  uint32_t iface = interfaceAddr(netif ? netif : _netif);
+  for (int i = 0; i < UDP_MAX_GROUPS; i++) {
+    udpGroup *g = &_groups[i];
+    if (g->group == addr && g->iface == iface) {
+      membership(IP_DROP_MEMBERSHIP, addr, iface);
+      g->group = 0;
+      if (group == _multicastIp) {
+        _multicastIp = ipNull;
       }
-      _multicastIp = addr;
+      return true;
     }
-    return true;
   }
   return false;
 }
 
+bool UDPClient::membership(int option, uint32_t group, uint32_t iface) {
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = group;
+  mreq.imr_interface.s_addr = iface;
+  if (lwip_setsockopt(_sock, IPPROTO_IP, option, &mreq, sizeof(mreq)) < 0) {
+    ESP_LOGD(TAG, "could not %s group %s: %d",
+             option == IP_ADD_MEMBERSHIP ? "join" : "leave",
+             IPAddress(group).toChar(), errno);
+    return false;
+  }
+  return true;
+}
+
+// the interface's address, network order (0 for the default interface)
+uint32_t UDPClient::interfaceAddr(esp_netif_t *netif) {
+  esp_netif_ip_info_t info;
+  if (!netif || esp_netif_get_ip_info(netif, &info) != ESP_OK) {
+    return 0;
+  }
+  return info.ip.addr;
+}
+
 void UDPClient::stop(void) {
   if (_sock != -1) {
-    if (_multicastIp != ipNull) {
-      struct ip_mreq mreq;
-      mreq.imr_multiaddr.s_addr = _multicastIp.toAddr();
-      mreq.imr_interface.s_addr = ipNull.toAddr();
-      setsockopt(_sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
-      _multicastIp = ipNull;
+    onPacket(NULL);
+    for (int i = 0; i < UDP_MAX_GROUPS; i++) {
+      if (_groups[i].group) {
+        membership(IP_DROP_MEMBERSHIP, _groups[i].group, _groups[i].iface);
+        _groups[i].group = 0;
+      }
     }
+    _multicastIp = ipNull;
+    _sourceFilter = false;
+    _netif = NULL;
     lwip_shutdown(_sock, 0);
     lwip_close(_sock);
     ESP_LOGD(TAG, "Socket shutdown");
+    _sock = -1;
   }
 }
 
@@ -185,29 +359,44 @@ bool UDPClient::beginMulticastPacket() {
   return beginPacket();
 }
 
-bool UDPClient::beginPacket() {
-  if (!_remotePort) {
+/**
+ * @brief start a packet to remoteIP()/remotePort(), e.g. a reply to the
+ * last datagram received
+ *
+ * @return true
+ * @return false no destination, or no socket
+ */
+bool UDPClient::beginPacket() { return startPacket(_remoteIp, _remotePort); }
+
+bool UDPClient::startPacket(IPAddress ip, uint16_t port) {
+  if (!port) {
     return false;
   }
   _txLen = 0;
-  if (_sock < 0) {
-    return true;
-  }
-
-  if ((_sock = lwip_socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-    ESP_LOGD(TAG, "could not create socket: %d", _sock);
+  if (!openSocket()) {
     return false;
   }
-
-  fcntl(_sock, F_SETFL, O_NONBLOCK);
-
+  setDestination(ip, port);
   return true;
 }
 
+// cache the destination, endPacket() sends there until the next
+// beginPacket()
+void UDPClient::setDestination(IPAddress ip, uint16_t port) {
+  if (!_dest_addr) {
+    _dest_addr = (struct sockaddr_in *)calloc(1, sizeof(struct sockaddr_in));
+  }
+  _dest_addr->sin_addr.s_addr = ip.toAddr();
+  _dest_addr->sin_family = AF_INET;
+  _dest_addr->sin_port = htons(port);
+}
+
+// the destination is taken from the arguments, not from remoteIP(): the
+// reactor task may be receiving (and changing it) meanwhile, see onPacket()
 bool UDPClient::beginPacket(IPAddress ip, uint16_t port) {
   _remoteIp = ip;
   _remotePort = port;
-  return beginPacket();
+  return startPacket(ip, port);
 }
 
 bool UDPClient::beginPacket(const char *host, uint16_t port) {
@@ -221,59 +410,333 @@ bool UDPClient::beginPacket(const char *host, uint16_t port) {
                      port);
 }
 
+/**
+ * @brief send the packet to the destination given to beginPacket(), once
+ * the pacer lets it go if there is one (see setPacer)
+ *
+ * @return true
+ * @return false not sent: no packet started, lwIP had no room for it (see
+ * getStats) or error
+ */
 bool UDPClient::endPacket() {
-  struct sockaddr_in recipient;
-  recipient.sin_addr.s_addr = _remoteIp.toAddr();
-  recipient.sin_family = AF_INET;
-  recipient.sin_port = htons(_remotePort);
+  if (!_dest_addr || _sock < 0) {
+    _txLen = 0;
+    return false;
+  }
+  if (_pacer) {
+    _pacer->pace(_txLen);
+  }
   int sent = lwip_sendto(_sock, _txBuffer, _txLen, 0,
-                         (struct sockaddr *)&recipient, sizeof(recipient));
+                         (struct sockaddr *)_dest_addr, sizeof(*_dest_addr));
   if (sent < 0) {
-    ESP_LOGD(TAG, "could not send data: %d", sent);
+    // lwIP says ENOMEM when it's out of buffers
+    if (errno == EWOULDBLOCK || errno == EAGAIN || errno == ENOMEM) {
+      _stats.wouldBlock++;
+    } else {
+      _stats.sendErrors++;
+    }
+    ESP_LOGD(TAG, "could not send data: %d", errno);
+    _txLen = 0;
     return false;
   }
+  _stats.packetsSent++;
+  _stats.bytesSent += _txLen;
+  _txLen = 0;
   return true;
 }
 
 size_t UDPClient::write(uint8_t data) {
-  if (_txLen == 1460) {
+  if (_txLen == UDP_MAX_PAYLOAD) {
     endPacket();
-    _txLen = 0;
   }
   _txBuffer[_txLen++] = data;
   return 1;
 }
 
+/**
+ * @brief add data to the packet, sending it when it's full (see
+ * setOverflowMode)
+ *
+ * @param buffer
+ * @param size
+ * @return size_t bytes written, 0 if the data can't fit a packet in
+ * UDP_OVERFLOW_SPLIT mode
+ */
 size_t UDPClient::write(const uint8_t *buffer, size_t size) {
-  size_t i;
-  for (i = 0; i < size; i++) write(buffer[i]);
-  return i;
+  if (_overflowMode == UDP_OVERFLOW_SPLIT && _txLen + size > UDP_MAX_PAYLOAD) {
+    if (size > UDP_MAX_PAYLOAD) {
+      ESP_LOGE(TAG, "%d bytes don't fit in a packet", size);
+      return 0;
+    }
+    endPacket();
+  }
+  size_t written = 0;
+  while (written < size) {
+    if (_txLen == UDP_MAX_PAYLOAD) {
+      endPacket();
+    }
+    size_t chunk = min(size - written, UDP_MAX_PAYLOAD - _txLen);
+    memcpy(_txBuffer + _txLen, buffer + written, chunk);
+    _txLen += chunk;
+    written += chunk;
+  }
+  return written;
 }
 
 size_t UDPClient::write(const char *buffer, size_t size) {
   return write((uint8_t *)buffer, size);
 }
 
+/**
+ * @brief what write() does with data that doesn't fit in the current packet
+ *
+ * @param mode UDP_OVERFLOW_FLUSH (default) fills the packet, sends it and
+ * goes on in the next one, for byte streams. UDP_OVERFLOW_SPLIT sends the
+ * packet first, so each write() (or printf()) lands whole in one datagram,
+ * for records.
+ */
+void UDPClient::setOverflowMode(udpOverflowMode mode) { _overflowMode = mode; }
+
+/**
+ * @brief pace the packets sent: endPacket() then waits for the bucket to
+ * have tokens for the packet (not from a reactor callback, it would stall
+ * the other sockets)
+ *
+ * @param pacer may be shared with other senders, NULL (default) to send
+ * right away
+ */
+void UDPClient::setPacer(TokenBucket *pacer) { _pacer = pacer; }
+
+/**
+ * @brief socket counters, e.g. to see how many packets are dropped when
+ * sending faster than lwIP can queue them
+ *
+ * @param stats
+ */
+void UDPClient::getStats(udpStats &stats) { stats = _stats; }
+
+void UDPClient::resetStats(void) { _stats = {}; }
+
+// the next datagram, skipping those a source-specific group doesn't accept
+int UDPClient::receiveFrom(uint8_t *buffer, size_t size,
+                           struct sockaddr_in &source) {
+  while (true) {
+    socklen_t slen = sizeof(source);
+    int len;
+#ifdef CONFIG_LWIP_NETBUF_RECVINFO
+    if (_sourceFilter) {
+      struct iovec iov = {.iov_base = buffer, .iov_len = size};
+      char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+      struct msghdr msg = {};
+      msg.msg_name = &source;
+      msg.msg_namelen = slen;
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      len = lwip_recvmsg(_sock, &msg, MSG_DONTWAIT);
+      if (len < 0) {
+        return len;
+      }
+      bool accepted = true;
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+           cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+          struct in_pktinfo info;
+          memcpy(&info, CMSG_DATA(cmsg), sizeof(info));
+          accepted = accepts(info.ipi_addr.s_addr, source.sin_addr.s_addr);
+        }
+      }
+      if (!accepted) {
+        _stats.filtered++;
+        continue;
+      }
+      return len;
+    }
+#endif
+    len = lwip_recvfrom(_sock, buffer, size, MSG_DONTWAIT,
+                        (struct sockaddr *)&source, &slen);
+    return len;
+  }
+}
+
+// false if the datagram was sent to a group that doesn't accept the source
+bool UDPClient::accepts(uint32_t group, uint32_t source) {
+  bool joined = false;
+  for (int i = 0; i < UDP_MAX_GROUPS; i++) {
+    udpGroup *g = &_groups[i];
+    if (g->group != group) {
+      continue;
+    }
+    if (!g->sourceCount) {
+      return true;
+    }
+    joined = true;
+    for (int j = 0; j < g->sourceCount; j++) {
+      if (g->sources[j] == source) {
+        return true;
+      }
+    }
+  }
+  return !joined;  // unicast, or a group without sources
+}
+
 int UDPClient::parsePacket() {
   struct sockaddr_in si_other;
-  int slen = sizeof(si_other);
-  if ((_rxLen = lwip_recvfrom(_sock, _rxBuffer, 1460, MSG_DONTWAIT,
-                              (struct sockaddr *)&si_other,
-                              (socklen_t *)&slen)) < 0) {
-    if (_rxLen == EWOULDBLOCK) {
-      return 0;
+  _rxPtr = 0;
+  _rxLen = receiveFrom(_rxBuffer, sizeof(_rxBuffer) - 1, si_other);
+  if (_rxLen < 0) {
+    if (errno != EWOULDBLOCK && errno != EAGAIN) {
+      ESP_LOGD(TAG, "could not receive data: %d", errno);
     }
-    ESP_LOGD(TAG, "could not receive data: %d", _rxLen);
+    _rxLen = 0;
     return 0;
   }
+  _rxBuffer[_rxLen] = 0;  // text protocols can parse it in place
+  _rxTime = millis();
+  _stats.packetsReceived++;
+  _stats.bytesReceived += _rxLen;
   _remoteIp = IPAddress(si_other.sin_addr.s_addr);
   _remotePort = ntohs(si_other.sin_port);
-  _rxPtr = 0;
   return _rxLen;
 }
 
+/**
+ * @brief look at the datagram received by parsePacket() without copying it
+ *
+ * @param packet set to what's left to read of the datagram (all of it until
+ * read() is called) and where it came from. The data stays valid until the
+ * next parsePacket().
+ * @return true
+ * @return false no datagram, or it has been read
+ */
+bool UDPClient::packet(udpPacket &packet) {
+  if (_rxLen <= 0) {
+    return false;
+  }
+  packet.data = _rxBuffer + _rxPtr;
+  packet.len = _rxLen;
+  packet.ip = _remoteIp;
+  packet.port = _remotePort;
+  packet.time = _rxTime;
+  return true;
+}
+
+/**
+ * @brief have datagrams delivered as they arrive instead of polling
+ * parsePacket(): the socket is watched by the SocketReactor task, which
+ * calls back for each datagram. Set it after begin(), stop() removes it.
+ *
+ * @param callback gets the datagram (see packet()), and can reply with
+ * beginPacket()/endPacket(). It runs on the reactor task and must not
+ * block. NULL stops the callbacks: once this returns, none is running.
+ * @param arg passed to the callback
+ * @return true
+ * @return false no socket, or the reactor has no free slot
+ */
+bool UDPClient::onPacket(udp_packet_callback callback, void *arg) {
+  if (_onPacket) {
+    SocketReactor::instance().remove(_sock);
+    _onPacket = NULL;
+  }
+  if (!callback) {
+    return true;
+  }
+  if (_sock < 0) {
+    return false;
+  }
+  _onPacket = callback;
+  _onPacketArg = arg;
+  if (!SocketReactor::instance().add(_sock, REACTOR_READ, readable, this)) {
+    _onPacket = NULL;
+    return false;
+  }
+  return true;
+}
+
+// reactor callback: deliver everything that's waiting
+void UDPClient::readable(int sock, int events, void *arg) {
+  UDPClient *client = (UDPClient *)arg;
+  udpPacket packet;
+  while (client->_onPacket && client->parsePacket() > 0 &&
+         client->packet(packet)) {
+    client->_onPacket(packet, client->_onPacketArg);
+  }
+}
+
+/**
+ * @brief drain the datagrams waiting on the socket in one call, so bursts
+ * don't overflow the socket buffer between two polls
+ *
+ * @param packets filled with up to count datagrams, each '\0' terminated
+ * in the slab
+ * @param count
+ * @param slab where the datagrams are stored, back to back. It stays in use
+ * until the packets are processed. Receiving stops when there is no room
+ * left for a UDP_MAX_DATAGRAM datagram. Larger ones (with IP reassembly on)
+ * that don't fit what's left are dropped, see udpStats.truncated.
+ * @param size
+ * @return int datagrams received (0 if none is waiting)
+ */
+int UDPClient::receiveBatch(udpPacket *packets, int count, uint8_t *slab,
+                            size_t size) {
+  int received = 0;
+  size_t used = 0;
+  while (received < count && size - used > UDP_MAX_DATAGRAM + 1) {
+    struct sockaddr_in source;
+    size_t room = size - used - 1;  // and the '\0'
+    int len = receiveFrom(slab + used, room, source);
+    if (len < 0) {
+      if (errno != EWOULDBLOCK && errno != EAGAIN) {
+        ESP_LOGD(TAG, "could not receive data: %d", errno);
+      }
+      break;
+    }
+    if ((size_t)len == room) {
+      // may have been cut there: the rest of it is lost
+      _stats.truncated++;
+      continue;
+    }
+    slab[used + len] = 0;
+    udpPacket &packet = packets[received++];
+    packet.data = slab + used;
+    packet.len = len;
+    packet.ip = IPAddress(source.sin_addr.s_addr);
+    packet.port = ntohs(source.sin_port);
+    packet.time = millis();
+    used += len + 1;
+    _stats.packetsReceived++;
+    _stats.bytesReceived += len;
+  }
+  return received;
+}
+
 bool UDPClient::available() { return (_rxLen > 0); }
 
+/**
+ * @brief wait for unread data or an incoming datagram, without spinning
+ *
+ * @param timeout in ms
+ * @return true parsePacket() or read() won't come back empty
+ * @return false timeout or error
+ */
+bool UDPClient::waitAvailable(uint32_t timeout) {
+  if (_rxLen > 0) {
+    return true;
+  }
+  if (_sock < 0) {
+    return false;
+  }
+  fd_set readSet;
+  FD_ZERO(&readSet);
+  FD_SET(_sock, &readSet);
+  struct timeval tv = {.tv_sec = (time_t)(timeout / 1000U),
+                       .tv_usec = (suseconds_t)((timeout % 1000U) * 1000U)};
+  return lwip_select(_sock + 1, &readSet, NULL, NULL, &tv) > 0;
+}
+
+int UDPClient::fd(void) { return _sock; }
+
 int UDPClient::read() {
   if (_rxLen <= 0) {
     return -1;
@@ -284,16 +747,14 @@ int UDPClient::read() {
 }
 
 int UDPClient::read(uint8_t *rxBuffer, size_t rxLen) {
-  size_t len = min(rxLen, _rxLen);
-  if (len <= 0) return 0;
-  memcpy((void *)rxBuffer, (void *)_rxBuffer, len);
-  rxLen = len;
-  if (len < _rxLen) {
-    memcpy((void *)_rxBuffer, (void *)(_rxBuffer + (_rxLen - len)),
-           _rxLen - len);
-    _rxLen -= len;
+  if (_rxLen <= 0) {
+    return 0;
   }
-  return rxLen;
+  size_t len = min(rxLen, (size_t)_rxLen);
+  memcpy(rxBuffer, _rxBuffer + _rxPtr, len);
+  _rxPtr += len;
+  _rxLen -= len;
+  return len;
 }
 
 int UDPClient::read(char *rxBuffer, size_t rxLen) {
@@ -352,14 +813,68 @@ void UDPClient::setTimeout(uint32_t timeout) {
 //   return read(rxBuffer, rxLen);
 // }
 
-void UDPClient::printf(const char *fmt, ...) {
+/**
+ * @brief formatted output, written straight into the packet buffer
+ *
+ * @param fmt
+ * @param ...
+ * @return int bytes written, -1 on error. Like write(), output that doesn't
+ * fit in the packet is sent over several packets, or in a packet of its own
+ * in UDP_OVERFLOW_SPLIT mode.
+ */
+int UDPClient::printf(const char *fmt, ...) {
   va_list args;
   va_start(args, fmt);
-  char buffer[1024];
+  int len = vprintf(fmt, args);
   va_end(args);
-  sprintf(buffer, fmt, args);
-  ESP_LOG_BUFFER_HEXDUMP(TAG, buffer, strlen(buffer), ESP_LOG_DEBUG);
-  write(buffer, strlen(buffer));
+  return len;
+}
+
+static ssize_t streamWrite(void *cookie, const char *buffer, size_t len) {
+  return ((UDPClient *)cookie)->write(buffer, len);
+}
+
+int UDPClient::vprintf(const char *fmt, va_list args) {
+  va_list copy;
+  size_t space = UDP_MAX_PAYLOAD - _txLen;
+  va_copy(copy, args);
+  // +1: vsnprintf needs room for its '\0', which isn't sent
+  int len = vsnprintf((char *)_txBuffer + _txLen, space + 1, fmt, copy);
+  va_end(copy);
+  if (len < 0) {
+    return -1;
+  }
+  if ((size_t)len <= space) {
+    _txLen += len;
+    return len;
+  }
+  if (_overflowMode == UDP_OVERFLOW_SPLIT) {
+    if (len > UDP_MAX_PAYLOAD) {
+      ESP_LOGE(TAG, "%d bytes don't fit in a packet", len);
+      return -1;
+    }
+    // a record of its own, in the next packet
+    endPacket();
+    va_copy(copy, args);
+    _txLen = vsnprintf((char *)_txBuffer, UDP_MAX_PAYLOAD + 1, fmt, copy);
+    va_end(copy);
+    return len;
+  }
+
+  // doesn't fit: stream it through write(), which sends full packets
+  cookie_io_functions_t functions = {NULL, streamWrite, NULL, NULL};
+  FILE *stream = fopencookie(this, "w", functions);
+  if (!stream) {
+    return -1;
+  }
+  setvbuf(stream, NULL, _IONBF, 0);
+  va_copy(copy, args);
+  len = vfprintf(stream, fmt, copy);
+  va_end(copy);
+  if (fclose(stream) != 0) {
+    return -1;
+  }
+  return len;
 }
 
 void UDPClient::flush() {
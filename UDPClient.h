@@ -29,7 +29,54 @@
 #define __UDPCLIENT_H_
 
 #include "IPAddress.h"
+#include "esp_netif.h"
 #include "utils.h"
+#include <stdarg.h>
+
+class TokenBucket;
+
+#define UDP_MAX_PAYLOAD 1460  // write() sends the packet when it reaches that
+#define UDP_MAX_DATAGRAM 1472  // largest in one 1500-byte frame (IP
+                               // reassembly is off by default)
+#define UDP_MAX_GROUPS 8      // multicast groups joined by one socket
+#define UDP_MAX_SOURCES 4     // sources accepted by a source-specific group
+
+typedef enum {
+  UDP_OVERFLOW_FLUSH = 0,  // send the full packet, go on in the next one
+  UDP_OVERFLOW_SPLIT,      // keep each write() whole, in the next packet
+} udpOverflowMode;
+
+// socket counters, since begin() or resetStats()
+typedef struct {
+  uint32_t packetsSent;
+  uint32_t bytesSent;
+  uint32_t sendErrors;
+  uint32_t wouldBlock;  // dropped, lwIP had no room to queue them
+  uint32_t packetsReceived;
+  uint32_t bytesReceived;
+  uint32_t filtered;  // from sources their group doesn't accept
+  uint32_t truncated;  // dropped, larger than the room left for them
+} udpStats;
+
+// a multicast group joined, see joinGroup()
+typedef struct {
+  uint32_t group;  // network order, 0 if the entry is free
+  uint32_t iface;  // address of the interface, 0 for the default one
+  uint8_t sourceCount;  // 0 to accept any source
+  uint32_t sources[UDP_MAX_SOURCES];
+} udpGroup;
+
+// the datagram being read, see UDPClient::packet()
+typedef struct {
+  const uint8_t *data;  // '\0' terminated
+  size_t len;
+  IPAddress ip;
+  uint16_t port;
+  unsigned long time;  // millis() when it was received
+} udpPacket;
+
+// called on the SocketReactor task for each datagram received, see onPacket()
+typedef void (*udp_packet_callback)(udpPacket &packet, void *arg);
 
 class UDPClient {
  public:
@@ -39,9 +86,19 @@ class UDPClient {
   bool begin(uint16_t port);
   bool begin(IPAddress addr, uint16_t port);
   bool beginMulticast(IPAddress addr, uint16_t port);
+  bool bindInterface(esp_netif_t *netif);
+  bool joinGroup(IPAddress group, esp_netif_t *netif = NULL);
+  bool joinGroup(IPAddress group, const IPAddress *sources, int count,
+                 esp_netif_t *netif = NULL);
+  bool leaveGroup(IPAddress group, esp_netif_t *netif = NULL);
   void setTimeout(uint32_t timeout);
   bool available(void);
+  bool waitAvailable(uint32_t timeout);
+  int fd(void);
   int parsePacket(void);
+  bool packet(udpPacket &packet);
+  int receiveBatch(udpPacket *packets, int count, uint8_t *slab, size_t size);
+  bool onPacket(udp_packet_callback callback, void *arg = NULL);
   int read(void);
   int peek(void);
   int read(uint8_t *buffer, size_t len);
@@ -49,12 +106,17 @@ class UDPClient {
   size_t write(uint8_t data);
   size_t write(const uint8_t *buffer, size_t size);
   size_t write(const char *buffer, size_t size);
+  void setOverflowMode(udpOverflowMode mode);
+  void setPacer(TokenBucket *pacer);
+  void getStats(udpStats &stats);
+  void resetStats(void);
   // int send(uint8_t *txBuffer, size_t txLen, uint32_t timeout);
   // int sendAndReceive(uint8_t *txBuffer, size_t txLen, uint8_t *rxBuffer,
   //                    size_t &rxLen, uint32_t timeout = 30000);
   // int receive(uint8_t *rxBuffer, size_t &rxLen, uint32_t timeout);
   void stop(void);
-  void printf(const char *fmt, ...);
+  int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+  int vprintf(const char *fmt, va_list args);
   bool beginPacket();
   bool beginPacket(IPAddress ip, uint16_t port);
   bool beginPacket(const char *host, uint16_t port);
@@ -67,12 +129,28 @@ class UDPClient {
   uint16_t remotePort();
 
  private:
-  int _sock;
-  // struct sockaddr_in _dest_addr, _src_addr;
-  uint8_t _rxBuffer[2048];
+  bool openSocket(void);
+  bool startPacket(IPAddress ip, uint16_t port);
+  void setDestination(IPAddress ip, uint16_t port);
+  static void readable(int sock, int events, void *arg);
+  int receiveFrom(uint8_t *buffer, size_t size, struct sockaddr_in &source);
+  bool accepts(uint32_t group, uint32_t source);
+  bool membership(int option, uint32_t group, uint32_t iface);
+  uint32_t interfaceAddr(esp_netif_t *netif);
+
+  int _sock = -1;
+  struct sockaddr_in *_dest_addr = NULL;  // cached by beginPacket()
+  udpStats _stats = {};
+  udp_packet_callback _onPacket = NULL;
+  void *_onPacketArg = NULL;
+  uint8_t _rxBuffer[2048];  // +1 byte to terminate the datagram
   int _rxLen = 0;
   int _rxPtr = 0;
-  IPAddress _multicastIp;
+  unsigned long _rxTime = 0;
+  IPAddress _multicastIp;  // the group beginMulticastPacket() sends to
+  udpGroup _groups[UDP_MAX_GROUPS] = {};
+  esp_netif_t *_netif = NULL;  // see bindInterface()
+  bool _sourceFilter = false;  // a group has sources
   IPAddress _remoteIp;
   uint16_t _remotePort = 0;
   uint16_t _serverPort = 0;
@@ -81,8 +159,10 @@ class UDPClient {
   char _hostname[100];
   char _cPort[6];
   char _protocol[16];
-  uint8_t _txBuffer[2048];
+  uint8_t _txBuffer[UDP_MAX_PAYLOAD + 1];  // +1 for vsnprintf's '\0'
   size_t _txLen = 0;
+  udpOverflowMode _overflowMode = UDP_OVERFLOW_FLUSH;
+  TokenBucket *_pacer = NULL;
 };
 
 #endif  // __UDPCLIENT_H_
\ No newline at end of file
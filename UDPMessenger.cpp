@@ -0,0 +1,295 @@
+/**
+ * @file UDPMessenger.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "UDPMessenger.h"
+#include "esp_log.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+
+static const char *TAG = "UDPMessenger";
+
+#define UDP_MESSENGER_MAGIC 0xa5
+#define UDP_MESSENGER_VERSION 1
+
+// in front of each fragment, numbers in network order
+typedef struct __attribute__((packed)) {
+  uint8_t magic;
+  uint8_t version;
+  uint16_t id;      // message ID, per sender
+  uint32_t offset;  // of the fragment's data in the message
+  uint32_t total;   // message length
+} udpFragmentHeader;
+
+static_assert(sizeof(udpFragmentHeader) == UDP_MESSENGER_HEADER_SIZE,
+              "fragment header size");
+
+UDPMessenger::UDPMessenger() {}
+
+UDPMessenger::~UDPMessenger() { stop(); }
+
+/**
+ * @brief bind a port and start reassembling messages received there
+ *
+ * @param port 0 for any, e.g. to only send
+ * @param callback gets each complete message, NULL to only send
+ * @param arg passed to the callback
+ * @param maxMessage largest message accepted, up to
+ * UDP_MESSENGER_MAX_FRAGMENTS fragments
+ * @param slots messages reassembled at the same time, each with a
+ * maxMessage buffer allocated here. Fragments of new messages are dropped
+ * while they're all in use.
+ * @param timeout in ms, for a message to complete
+ * @return true
+ * @return false bad arguments, or allocation/socket failed
+ */
+bool UDPMessenger::begin(uint16_t port, udp_message_callback callback,
+                         void *arg, size_t maxMessage, int slots,
+                         uint32_t timeout) {
+  stop();
+  if (maxMessage >
+          UDP_MESSENGER_MAX_FRAGMENTS * (size_t)UDP_MESSENGER_FRAGMENT_SIZE ||
+      slots < 1) {
+    return false;
+  }
+  _callback = callback;
+  _arg = arg;
+  _maxMessage = maxMessage;
+  _timeout = timeout;
+  _nextId = esp_random();
+  _stats = {};
+  if (!_udp.begin(port)) {
+    return false;
+  }
+  if (!callback) {
+    return true;
+  }
+  // messages that fit a fragment are delivered straight from the datagram
+  if (maxMessage > UDP_MESSENGER_FRAGMENT_SIZE) {
+    _slots = (udpReassembly *)calloc(slots, sizeof(udpReassembly));
+    _pool = (uint8_t *)malloc(slots * (maxMessage + 1));
+    if (!_slots || !_pool) {
+      ESP_LOGE(TAG, "Could not allocate %d reassembly slots of %d bytes",
+               slots, maxMessage);
+      stop();
+      return false;
+    }
+    _slotCount = slots;
+    for (int i = 0; i < slots; i++) {
+      _slots[i].data = _pool + i * (maxMessage + 1);
+    }
+  }
+  if (!_udp.onPacket(onFragment, this)) {
+    stop();
+    return false;
+  }
+  return true;
+}
+
+void UDPMessenger::stop(void) {
+  _udp.stop();  // no fragment is being handled after that
+  free(_slots);
+  free(_pool);
+  _slots = NULL;
+  _pool = NULL;
+  _slotCount = 0;
+}
+
+/**
+ * @brief send a message, in as many datagrams as needed
+ *
+ * @param ip
+ * @param port
+ * @param buffer
+ * @param len up to UDP_MESSENGER_MAX_FRAGMENTS fragments (the receiver may
+ * accept less)
+ * @return true
+ * @return false too long, not started, or a fragment couldn't be sent
+ */
+bool UDPMessenger::send(IPAddress ip, uint16_t port, const uint8_t *buffer,
+                        size_t len) {
+  if (len > UDP_MESSENGER_MAX_FRAGMENTS * (size_t)UDP_MESSENGER_FRAGMENT_SIZE) {
+    ESP_LOGE(TAG, "%d bytes is too long for a message", len);
+    return false;
+  }
+  udpFragmentHeader header;
+  header.magic = UDP_MESSENGER_MAGIC;
+  header.version = UDP_MESSENGER_VERSION;
+  header.id = htons(_nextId++);
+  header.total = htonl(len);
+  size_t offset = 0;
+  do {
+    size_t chunk = min(len - offset, (size_t)UDP_MESSENGER_FRAGMENT_SIZE);
+    header.offset = htonl(offset);
+    // fragments go out back to back: when lwIP runs out of buffers, give it
+    // a tick to send some rather than losing the whole message
+    int retries = UDP_MESSENGER_SEND_RETRIES;
+    while (true) {
+      if (!_udp.beginPacket(ip, port)) {
+        return false;
+      }
+      _udp.write((const uint8_t *)&header, sizeof(header));
+      _udp.write(buffer + offset, chunk);
+      udpStats before;
+      _udp.getStats(before);
+      if (_udp.endPacket()) {
+        break;
+      }
+      udpStats after;
+      _udp.getStats(after);
+      if (after.wouldBlock == before.wouldBlock || retries-- == 0) {
+        ESP_LOGD(TAG, "could not send fragment at %d of message %d", offset,
+                 ntohs(header.id));
+        return false;
+      }
+      vTaskDelay(1);
+    }
+    _stats.fragmentsSent++;
+    offset += chunk;
+  } while (offset < len);
+  _stats.messagesSent++;
+  return true;
+}
+
+/**
+ * @brief pace the fragments, so a large message doesn't go out as one burst
+ *
+ * @param pacer see UDPClient::setPacer()
+ */
+void UDPMessenger::setPacer(TokenBucket *pacer) { _udp.setPacer(pacer); }
+
+void UDPMessenger::getStats(udpMessengerStats &stats) { stats = _stats; }
+
+// reactor callback
+void UDPMessenger::onFragment(udpPacket &packet, void *arg) {
+  ((UDPMessenger *)arg)->fragment(packet);
+}
+
+void UDPMessenger::fragment(udpPacket &packet) {
+  if (packet.len < sizeof(udpFragmentHeader)) {
+    _stats.dropped++;
+    return;
+  }
+  udpFragmentHeader header;
+  memcpy(&header, packet.data, sizeof(header));
+  uint16_t id = ntohs(header.id);
+  uint32_t offset = ntohl(header.offset);
+  uint32_t total = ntohl(header.total);
+  const uint8_t *data = packet.data + sizeof(header);
+  size_t len = packet.len - sizeof(header);
+  // the sender cuts the message in UDP_MESSENGER_FRAGMENT_SIZE pieces
+  if (header.magic != UDP_MESSENGER_MAGIC ||
+      header.version != UDP_MESSENGER_VERSION || total > _maxMessage ||
+      offset % UDP_MESSENGER_FRAGMENT_SIZE ||
+      (total && offset >= total) ||
+      len != min(total - offset, (uint32_t)UDP_MESSENGER_FRAGMENT_SIZE)) {
+    ESP_LOGD(TAG, "dropped fragment from %s:%d", packet.ip.toChar(),
+             packet.port);
+    _stats.dropped++;
+    return;
+  }
+  _stats.fragmentsReceived++;
+
+  udpMessage message;
+  message.ip = packet.ip;
+  message.port = packet.port;
+  if (len == total) {
+    // single fragment, it ends the datagram so it's terminated already
+    message.data = data;
+    message.len = len;
+    _stats.messagesReceived++;
+    _callback(message, _arg);
+    return;
+  }
+
+  udpReassembly *slot =
+      findSlot(packet.ip.toAddr(), packet.port, id, packet.time);
+  if (!slot) {
+    ESP_LOGD(TAG, "no free slot for message %d from %s:%d", id,
+             packet.ip.toChar(), packet.port);
+    _stats.dropped++;
+    return;
+  }
+  if (!slot->received) {
+    slot->total = total;
+  } else if (slot->total != total) {
+    _stats.dropped++;
+    return;
+  }
+  uint64_t bit = 1ULL << (offset / UDP_MESSENGER_FRAGMENT_SIZE);
+  if (slot->fragments & bit) {
+    return;  // duplicate
+  }
+  memcpy(slot->data + offset, data, len);
+  slot->fragments |= bit;
+  slot->received += len;
+  if (slot->received < slot->total) {
+    return;
+  }
+  slot->data[total] = 0;
+  message.data = slot->data;
+  message.len = total;
+  _stats.messagesReceived++;
+  _callback(message, _arg);
+  slot->used = false;
+}
+
+// the slot reassembling that message, or a free one for it (after dropping
+// the messages that timed out), NULL if there's none
+udpReassembly *UDPMessenger::findSlot(uint32_t addr, uint16_t port,
+                                      uint16_t id, unsigned long now) {
+  udpReassembly *unused = NULL;
+  for (int i = 0; i < _slotCount; i++) {
+    udpReassembly *slot = &_slots[i];
+    if (slot->used) {
+      if (slot->addr == addr && slot->port == port && slot->id == id) {
+        return slot;
+      }
+      if (now - slot->started <= _timeout) {
+        continue;
+      }
+      ESP_LOGD(TAG, "message %d timed out, %lu of %lu bytes", slot->id,
+               slot->received, slot->total);
+      slot->used = false;
+      _stats.timedOut++;
+    }
+    if (!unused) {
+      unused = slot;
+    }
+  }
+  if (unused) {
+    unused->used = true;
+    unused->addr = addr;
+    unused->port = port;
+    unused->id = id;
+    unused->received = 0;
+    unused->fragments = 0;
+    unused->started = now;
+  }
+  return unused;
+}
@@ -0,0 +1,116 @@
+/**
+ * @file UDPMessenger.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __UDPMESSENGER_H_
+#define __UDPMESSENGER_H_
+
+#include "UDPClient.h"
+#include "utils.h"
+
+#define UDP_MESSENGER_HEADER_SIZE 12  // in front of each fragment
+#define UDP_MESSENGER_FRAGMENT_SIZE \
+  (UDP_MAX_PAYLOAD - UDP_MESSENGER_HEADER_SIZE)
+#define UDP_MESSENGER_MAX_FRAGMENTS 64  // per message, ~90 KB
+#define UDP_MESSENGER_MAX_MESSAGE 16384  // default reassembly buffer size
+#define UDP_MESSENGER_SLOTS 4    // messages reassembled at the same time
+#define UDP_MESSENGER_TIMEOUT_MS 2000  // incomplete messages are dropped then
+#define UDP_MESSENGER_SEND_RETRIES 20  // ticks waited for lwIP buffers
+
+// a whole message, see udp_message_callback
+typedef struct {
+  const uint8_t *data;  // '\0' terminated
+  size_t len;
+  IPAddress ip;
+  uint16_t port;
+} udpMessage;
+
+// called on the SocketReactor task for each complete message. The data is
+// only valid during the call.
+typedef void (*udp_message_callback)(udpMessage &message, void *arg);
+
+typedef struct {
+  uint32_t messagesSent;
+  uint32_t fragmentsSent;
+  uint32_t messagesReceived;
+  uint32_t fragmentsReceived;
+  uint32_t timedOut;  // incomplete messages dropped after the timeout
+  uint32_t dropped;   // fragments too large, malformed, or no free slot
+} udpMessengerStats;
+
+// a message being reassembled
+typedef struct {
+  bool used;
+  uint32_t addr;  // sender, network order
+  uint16_t port;
+  uint16_t id;
+  uint32_t total;     // message length
+  uint32_t received;  // bytes so far
+  uint64_t fragments;  // bit per fragment received
+  unsigned long started;  // millis() at the first fragment
+  uint8_t *data;  // in the preallocated pool, +1 byte to terminate
+} udpReassembly;
+
+/**
+ * @brief messages larger than a datagram over UDP. Each message is sent as
+ * fragments carrying a message ID and the offset of their data; the
+ * receiver puts them back together in a fixed number of preallocated
+ * slots, in any order, ignoring duplicates, and drops messages that don't
+ * complete in time. There is no retransmission: a lost fragment loses the
+ * message.
+ */
+class UDPMessenger {
+ public:
+  UDPMessenger();
+  ~UDPMessenger();
+  bool begin(uint16_t port, udp_message_callback callback, void *arg = NULL,
+             size_t maxMessage = UDP_MESSENGER_MAX_MESSAGE,
+             int slots = UDP_MESSENGER_SLOTS,
+             uint32_t timeout = UDP_MESSENGER_TIMEOUT_MS);
+  void stop(void);
+  bool send(IPAddress ip, uint16_t port, const uint8_t *buffer, size_t len);
+  void setPacer(TokenBucket *pacer);
+  void getStats(udpMessengerStats &stats);
+
+ private:
+  void fragment(udpPacket &packet);
+  udpReassembly *findSlot(uint32_t addr, uint16_t port, uint16_t id,
+                          unsigned long now);
+  static void onFragment(udpPacket &packet, void *arg);
+
+  UDPClient _udp;
+  udp_message_callback _callback = NULL;
+  void *_arg = NULL;
+  size_t _maxMessage = 0;
+  int _slotCount = 0;
+  uint32_t _timeout = 0;
+  udpReassembly *_slots = NULL;
+  uint8_t *_pool = NULL;  // _slotCount buffers of _maxMessage + 1 bytes
+  uint16_t _nextId = 0;
+  udpMessengerStats _stats = {};
+};
+
+#endif  // __UDPMESSENGER_H_
@@ -0,0 +1,256 @@
+/**
+ * @file UDPServer.cpp
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#include "UDPServer.h"
+#include "esp_log.h"
+
+static const char *TAG = "UDPServer";
+
+UDPServer::UDPServer() {}
+
+UDPServer::~UDPServer() { stop(); }
+
+/**
+ * @brief bind a port and start the server task
+ *
+ * @param port
+ * @param handler handles one datagram
+ * @param arg passed to the handler and to expired
+ * @param expired called when a peer expires, may be NULL
+ * @param maxPeers peers tracked at the same time. Datagrams from new peers
+ * are dropped while the table is full.
+ * @param idleTimeout in ms, peers expire when silent that long
+ * @return true
+ * @return false already running, or socket/task creation failed
+ */
+bool UDPServer::begin(uint16_t port, udp_server_handler handler, void *arg,
+                      udp_peer_callback expired, int maxPeers,
+                      uint32_t idleTimeout) {
+  if (_running || !handler || maxPeers < 1 || maxPeers > INT16_MAX) {
+    return false;
+  }
+  int buckets = 1;
+  while (buckets < maxPeers) {
+    buckets <<= 1;
+  }
+  _peers = (udpPeer *)calloc(maxPeers, sizeof(udpPeer));
+  _buckets = (int16_t *)malloc(buckets * sizeof(int16_t));
+  _slab = (uint8_t *)malloc(UDP_SERVER_SLAB_SIZE);
+  _exited = xSemaphoreCreateBinary();
+  if (!_peers || !_buckets || !_slab || !_exited) {
+    ESP_LOGE(TAG, "Could not allocate the peer table for %d peers",
+             maxPeers);
+    stop();
+    return false;
+  }
+  for (int i = 0; i < buckets; i++) {
+    _buckets[i] = -1;
+  }
+  for (int i = 0; i < maxPeers; i++) {
+    _peers[i].next = (i + 1 < maxPeers) ? i + 1 : -1;
+  }
+  _free = 0;
+  _bucketMask = buckets - 1;
+  _peerCount = 0;
+  _dropped = 0;
+
+  if (!_udp.begin(port)) {
+    ESP_LOGE(TAG, "Unable to bind port %d", port);
+    stop();
+    return false;
+  }
+  _port = port;
+  _handler = handler;
+  _expired = expired;
+  _arg = arg;
+  _idleTimeout = idleTimeout;
+  _running = true;
+  if (xTaskCreate(serverTask, "udp_server", UDP_SERVER_TASK_STACK_SIZE, this,
+                  UDP_SERVER_TASK_PRIORITY, NULL) != pdPASS) {
+    ESP_LOGE(TAG, "Could not start the server task");
+    _running = false;
+    stop();
+    return false;
+  }
+  ESP_LOGI(TAG, "Listening on port %d (%d peers max)", port, maxPeers);
+  return true;
+}
+
+/**
+ * @brief stop the server task (within UDP_SERVER_WAIT_MS), expire all peers
+ * and close the socket
+ */
+void UDPServer::stop(void) {
+  if (_running) {
+    _running = false;
+    xSemaphoreTake(_exited, portMAX_DELAY);
+    expirePeers(millis(), true);
+    ESP_LOGI(TAG, "Server on port %d stopped", _port);
+  }
+  _udp.stop();
+  free(_peers);
+  free(_buckets);
+  free(_slab);
+  _peers = NULL;
+  _buckets = NULL;
+  _slab = NULL;
+  if (_exited) {
+    vSemaphoreDelete(_exited);
+    _exited = NULL;
+  }
+}
+
+/**
+ * @brief send a datagram to a peer, from the server's socket. Meant for the
+ * handlers (they all run on the server task).
+ *
+ * @param peer
+ * @param buffer
+ * @param len
+ * @return true
+ * @return false not sent, see UDPClient::endPacket()
+ */
+bool UDPServer::send(udpPeer &peer, const uint8_t *buffer, size_t len) {
+  if (!_udp.beginPacket(IPAddress(peer.addr), peer.port) ||
+      _udp.write(buffer, len) != len) {
+    return false;
+  }
+  return _udp.endPacket();
+}
+
+/**
+ * @brief
+ *
+ * @return int peers currently tracked
+ */
+int UDPServer::peers(void) { return _peerCount; }
+
+/**
+ * @brief
+ *
+ * @return uint32_t datagrams dropped because the peer table was full
+ */
+uint32_t UDPServer::dropped(void) { return _dropped; }
+
+uint16_t UDPServer::port(void) { return _port; }
+
+int UDPServer::bucket(uint32_t addr, uint16_t port) {
+  // Fibonacci hashing, peers on a subnet differ in a few bits only
+  uint32_t key = (addr ^ ((uint32_t)port << 16) ^ port) * 2654435761U;
+  return (key >> 16) & _bucketMask;
+}
+
+// the peer for an address and port, added if it's new (NULL if the table
+// is full)
+udpPeer *UDPServer::findPeer(uint32_t addr, uint16_t port,
+                             unsigned long now) {
+  int b = bucket(addr, port);
+  for (int16_t i = _buckets[b]; i >= 0; i = _peers[i].next) {
+    if (_peers[i].addr == addr && _peers[i].port == port) {
+      return &_peers[i];
+    }
+  }
+  if (_free < 0) {
+    return NULL;
+  }
+  int16_t i = _free;
+  udpPeer *peer = &_peers[i];
+  _free = peer->next;
+  peer->addr = addr;
+  peer->port = port;
+  peer->lastSeen = now;
+  peer->packets = 0;
+  peer->session = NULL;
+  peer->next = _buckets[b];
+  _buckets[b] = i;
+  _peerCount++;
+  return peer;
+}
+
+void UDPServer::expirePeers(unsigned long now, bool all) {
+  for (int b = 0; b <= _bucketMask; b++) {
+    int16_t *link = &_buckets[b];
+    while (*link >= 0) {
+      int16_t i = *link;
+      udpPeer *peer = &_peers[i];
+      if (!all && now - peer->lastSeen < _idleTimeout) {
+        link = &peer->next;
+        continue;
+      }
+      ESP_LOGD(TAG, "Peer %s:%d expired", IPAddress(peer->addr).toChar(),
+               peer->port);
+      if (_expired) {
+        _expired(*peer, _arg);
+      }
+      *link = peer->next;
+      peer->next = _free;
+      _free = i;
+      _peerCount--;
+    }
+  }
+}
+
+void UDPServer::serve(void) {
+  udpPacket packets[UDP_SERVER_BATCH];
+  unsigned long lastExpiry = millis();
+  uint32_t reported = _dropped;  // drops are logged once per interval
+  while (_running) {
+    _udp.waitAvailable(UDP_SERVER_WAIT_MS);
+    int count = _udp.receiveBatch(packets, UDP_SERVER_BATCH, _slab,
+                                  UDP_SERVER_SLAB_SIZE);
+    for (int i = 0; i < count; i++) {
+      udpPacket &packet = packets[i];
+      udpPeer *peer = findPeer(packet.ip.toAddr(), packet.port, packet.time);
+      if (!peer) {
+        _dropped++;
+        ESP_LOGD(TAG, "Peer table full, dropped a datagram from %s:%d",
+                 packet.ip.toChar(), packet.port);
+        continue;
+      }
+      peer->lastSeen = packet.time;
+      peer->packets++;
+      _handler(*peer, packet, _arg);
+    }
+    unsigned long now = millis();
+    if (now - lastExpiry >= UDP_SERVER_WAIT_MS) {
+      expirePeers(now);
+      lastExpiry = now;
+      if (_dropped != reported) {
+        ESP_LOGW(TAG, "Peer table full, dropped %lu datagrams",
+                 (unsigned long)(_dropped - reported));
+        reported = _dropped;
+      }
+    }
+  }
+}
+
+void UDPServer::serverTask(void *arg) {
+  UDPServer *server = (UDPServer *)arg;
+  server->serve();
+  xSemaphoreGive(server->_exited);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,105 @@
+/**
+ * @file UDPServer.h
+ * @author Phil Hilger (phil@peergum.com)
+ * @brief 
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * CAN-talk. A library for microcontrollers that allows decent comms
+ * over a CAN bus.
+ * 
+ * Copyright (C) 2023, PeerGum
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https: //www.gnu.org/licenses/>.
+ * 
+ */
+
+#ifndef __UDPSERVER_H_
+#define __UDPSERVER_H_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "UDPClient.h"
+#include "utils.h"
+
+#define UDP_SERVER_MAX_PEERS 256
+#define UDP_SERVER_IDLE_TIMEOUT_MS 60000  // peers silent that long expire
+#define UDP_SERVER_BATCH 16         // datagrams drained per receive call
+#define UDP_SERVER_SLAB_SIZE 8192   // where they are received
+#define UDP_SERVER_TASK_STACK_SIZE 4096
+#define UDP_SERVER_TASK_PRIORITY 5
+#define UDP_SERVER_WAIT_MS 500  // how often stop() and expiry are checked
+
+typedef struct {
+  uint32_t addr;  // network order, IPAddress(addr) gives the IPAddress
+  uint16_t port;
+  int16_t next;            // hash chain
+  unsigned long lastSeen;  // millis()
+  uint32_t packets;
+  void *session;  // the handler's per-peer state, see udp_peer_callback
+} udpPeer;
+
+// called on the server task for each datagram, with the peer it came from
+typedef void (*udp_server_handler)(udpPeer &peer, udpPacket &packet,
+                                   void *arg);
+// called when a peer expires (or the server stops), to free its session
+typedef void (*udp_peer_callback)(udpPeer &peer, void *arg);
+
+/**
+ * @brief UDP server: one socket for all peers. A task receives datagrams in
+ * batches and hands each one to the handler along with its peer, found in a
+ * hash table keyed by address and port. Peers are added on their first
+ * datagram and expire after being idle for a while, so the handler can keep
+ * per-peer sessions without one socket per peer.
+ */
+class UDPServer {
+ public:
+  UDPServer();
+  ~UDPServer();
+  bool begin(uint16_t port, udp_server_handler handler, void *arg = NULL,
+             udp_peer_callback expired = NULL,
+             int maxPeers = UDP_SERVER_MAX_PEERS,
+             uint32_t idleTimeout = UDP_SERVER_IDLE_TIMEOUT_MS);
+  void stop(void);
+  bool send(udpPeer &peer, const uint8_t *buffer, size_t len);
+  int peers(void);
+  uint32_t dropped(void);
+  uint16_t port(void);
+
+ private:
+  void serve(void);
+  udpPeer *findPeer(uint32_t addr, uint16_t port, unsigned long now);
+  void expirePeers(unsigned long now, bool all = false);
+  int bucket(uint32_t addr, uint16_t port);
+  static void serverTask(void *arg);
+
+  UDPClient _udp;
+  uint16_t _port = 0;
+  bool _running = false;
+  udp_server_handler _handler = NULL;
+  udp_peer_callback _expired = NULL;
+  void *_arg = NULL;
+  uint32_t _idleTimeout = 0;
+  udpPeer *_peers = NULL;  // maxPeers entries
+  int16_t *_buckets = NULL;
+  int _bucketMask = 0;
+  int16_t _free = -1;  // unused entries, chained through next
+  int _peerCount = 0;
+  uint32_t _dropped = 0;  // datagrams from new peers when the table is full
+  uint8_t *_slab = NULL;
+  SemaphoreHandle_t _exited = NULL;
+};
+
+#endif  // __UDPSERVER_H_
@@ -27,6 +27,7 @@
 
 #include "Wifi.h"
 #include "SoftTimer.h"
+#include "lwip/sockets.h"
 #include <string>
 #include "esp_log.h"
 #include <cstring>
@@ -38,10 +39,6 @@ static const char *TAG = "UPnP";
 IPAddress ipMulti(239, 255, 255, 250);           // multicast address for SSDP
 IPAddress connectivityTestIp(64, 233, 187, 99);  // Google
 
-char packetBuffer[UDP_TX_PACKET_MAX_SIZE];  // buffer to hold incoming packet
-                                            // UDP_TX_PACKET_MAX_SIZE=8192
-char responseBuffer[UDP_TX_RESPONSE_MAX_SIZE];
-
 char tmpBody[1200];
 char integerString[32];
 
@@ -98,9 +95,33 @@ UPnP::UPnP(unsigned long timeoutMs) {
   _consecutiveFails = 0;
   _headRuleNode = NULL;
   clearGatewayInfo(&_gwInfo);
+  _tcpClient = NULL;
+  _keepAlive = false;
+  _ssdpHead = _ssdpTail = NULL;
+  _ssdpFound = NULL;
+  _state = UPNP_IDLE;
+  _result = NOP;
+  _resultCallback = NULL;
+  _resultArg = NULL;
+  _currentRule = NULL;
+  _stateStart = _rulesStart = _exchangeStart = _wakeAt = 0;
+  _requestSent = false;
+  memset(&_response, 0, sizeof(_response));
+  _tries = 0;
+  _addedPortMappings = 0;
+  _listIndex = 0;
+  _listRule = {};
 }
 
-UPnP::~UPnP() {}
+UPnP::~UPnP() {
+  _udpClient.stop();
+  freeSsdpDevices();
+  if (_ssdpFound) {
+    vSemaphoreDelete(_ssdpFound);
+  }
+  free(_listRule.devFriendlyName);
+  free(_listRule.protocol);
+}
 
 void UPnP::addPortMappingConfig(IPAddress ruleIP, int rulePort,
                                 const char *ruleProtocol, int ruleLeaseDuration,
@@ -133,176 +154,437 @@ void UPnP::addPortMappingConfig(IPAddress ruleIP, int rulePort,
   }
 }
 
+/**
+ * @brief add the configured port mappings to the IGD, blocking until it's
+ * done (see startPortMappings() to do it in the background)
+ *
+ * @return portMappingResult NOP if a run is already in progress
+ */
 portMappingResult UPnP::commitPortMappings() {
+  if (busy()) {
+    return NOP;
+  }
+  if (startPortMappings()) {
+    while (busy()) {
+      step();
+      vTaskDelay(pdMS_TO_TICKS(UPNP_STEP_MS));
+    }
+  }
+  return _result;
+}
+
+/**
+ * @brief start adding the configured port mappings to the IGD. The run is
+ * driven by calling step() regularly (e.g. from a task's main loop), which
+ * never blocks: discovery, connections and HTTP exchanges with the IGD
+ * progress a little on each call.
+ *
+ * @param callback called from step() with the result, once the run is over
+ * @param arg passed to the callback
+ * @return true the run started
+ * @return false a run is already in progress, or there is no port mapping
+ * configured (the callback was called with EMPTY_PORT_MAPPING_CONFIG)
+ */
+bool UPnP::startPortMappings(upnp_result_callback callback, void *arg) {
+  if (busy()) {
+    return false;
+  }
+  _resultCallback = callback;
+  _resultArg = arg;
   if (!_headRuleNode) {
     ESP_LOGD(TAG, "ERROR: No UPnP port mapping was set.");
-    return EMPTY_PORT_MAPPING_CONFIG;
+    finish(EMPTY_PORT_MAPPING_CONFIG);
+    return false;
   }
+  ESP_LOGI(TAG, "Testing wifi connection for [%s]", wifi.localIP().toChar());
+  enterState(UPNP_PROBE);
+  return true;
+}
 
-  // verify wifi is connected
-  if (!testConnectivity()) {
-    ESP_LOGD(TAG, "ERROR: not connected to wifi, cannot continue");
-    return NETWORK_ERROR;
+/**
+ * @brief start logging the port mappings found in the IGD, one per step()
+ * like a port mapping run (see printAllPortMappings() to wait for it). It
+ * can be started from the callback of startPortMappings().
+ *
+ * @return true the listing started
+ * @return false a run is in progress, or the IGD isn't known yet
+ */
+bool UPnP::startPortMappingList(void) {
+  if (busy()) {
+    return false;
   }
-
-  SoftTimer t;
-  // get all the needed IGD information using SSDP if we don't have it already
   if (!isGatewayInfoValid(&_gwInfo)) {
-    getGatewayInfo(&_gwInfo);
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-      ESP_LOGD(TAG, "ERROR: Invalid router info, cannot continue");
-      _tcpClient.close();
-      return NETWORK_ERROR;
-    }
-    delay(1000);  // longer delay to allow more time for the router to update
-                  // its rules
+    ESP_LOGD(TAG, "Invalid router info, cannot continue");
+    return false;
   }
+  _resultCallback = NULL;
+  _resultArg = NULL;
+  _listIndex = 0;
+  ESP_LOGD(TAG, "IGD current port mappings:");
+  enterState(UPNP_LIST);
+  return true;
+}
 
-  ESP_LOGD(TAG, "port [%d] actionPort [%d]", _gwInfo.port, _gwInfo.actionPort);
-
-  // double verify gateway information is valid
-  if (!isGatewayInfoValid(&_gwInfo)) {
-    ESP_LOGD(TAG, "ERROR: Invalid router info, cannot continue");
-    return NETWORK_ERROR;
-  }
-
-  if (_gwInfo.port != _gwInfo.actionPort) {
-    // in this case we need to connect to a different port
-    ESP_LOGD(TAG, "Connection port changed, disconnecting from IGD");
-    _tcpClient.close();
-  }
-
-  bool allPortMappingsAlreadyExist = true;  // for debug
-  int addedPortMappings = 0;                // for debug
-  upnpRuleNode *currNode = _headRuleNode;
-
-  t.reset();
-  while (currNode != NULL) {
-    ESP_LOGI(TAG, "Verify port mapping for rule [%s]",
-             currNode->upnpRule->devFriendlyName);
-    bool currPortMappingAlreadyExists = true;  // for debug
-    // TODO: since verifyPortMapping connects to the IGD then
-    // addPortMappingEntry can skip it
-    if (!verifyPortMapping(&_gwInfo, currNode->upnpRule)) {
-      // need to add the port mapping
-      currPortMappingAlreadyExists = false;
-      allPortMappingsAlreadyExist = false;
-      if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-        ESP_LOGD(TAG, "Timeout expired while trying to add a port mapping");
-        _tcpClient.close();
-        return TIMEOUT;
-      }
+bool UPnP::busy(void) { return _state != UPNP_IDLE; }
 
-      addPortMappingEntry(&_gwInfo, currNode->upnpRule);
+/**
+ * @brief move the port mapping run forward, without waiting for the network
+ * (a few ms at most, to parse a response already received)
+ */
+void UPnP::step(void) {
+  if (_state == UPNP_IDLE || (long)(millis() - _wakeAt) < 0) {
+    return;
+  }
+  switch (_state) {
+    case UPNP_PROBE:
+      stepProbe();
+      return;
+    case UPNP_DISCOVER:
+      stepDiscover();
+      return;
+    default:
+      break;
+  }
+  int port = (_state == UPNP_DESCRIBE) ? _gwInfo.port : _gwInfo.actionPort;
+  int ready = stepExchange(port);
+  if (ready) {
+    handleResponse(ready > 0);
+  }
+}
 
-      int tries = 0;
-      while (tries <= 3) {
-        delay(2000);  // longer delay to allow more time for the router to
-                      // update its rules
-        if (verifyPortMapping(&_gwInfo, currNode->upnpRule)) {
-          break;
-        }
-        tries++;
-      }
+void UPnP::enterState(upnpState state) {
+  _state = state;
+  _stateStart = millis();
+  _wakeAt = _stateStart;
+  _requestSent = false;
+}
 
-      if (tries > 3) {
-        _tcpClient.close();
-        return VERIFICATION_FAILED;
-      }
-    }
+// let step() skip its calls for that long
+void UPnP::pause(unsigned long ms) { _wakeAt = millis() + ms; }
 
-    if (!currPortMappingAlreadyExists) {
-      addedPortMappings++;
-      ESP_LOGI(TAG, "Port mapping [%s] was added",
-               currNode->upnpRule->devFriendlyName);
-    }
+// the current state has been going on for that long (0: never expires)
+bool UPnP::expired(unsigned long ms) {
+  return ms > 0 && millis() - _stateStart >= ms;
+}
 
-    currNode = currNode->next;
-    vTaskDelay(pdMS_TO_TICKS(100));
+void UPnP::finish(portMappingResult result) {
+  disconnectFromIGD();
+  _udpClient.stop();
+  freeSsdpDevices();
+  _state = UPNP_IDLE;
+  _result = result;
+  if (_resultCallback) {
+    _resultCallback(result, _resultArg);
   }
+}
 
-  _tcpClient.close();
-
-  if (allPortMappingsAlreadyExist) {
+// the current rule is in the IGD, go on with the next one
+void UPnP::nextRule(void) {
+  _currentRule = _currentRule->next;
+  if (_currentRule) {
+    enterState(UPNP_VERIFY);
+    return;
+  }
+  if (!_addedPortMappings) {
     ESP_LOGI(
         TAG,
         "All port mappings were already found in the IGD, not doing anything");
-    return ALREADY_MAPPED;
+    finish(ALREADY_MAPPED);
   } else {
-    // addedPortMappings is at least 1 here
-    if (addedPortMappings > 1) {
-      ESP_LOGI(TAG, "%d UPnP port mappings were added", addedPortMappings);
+    if (_addedPortMappings > 1) {
+      ESP_LOGI(TAG, "%d UPnP port mappings were added", _addedPortMappings);
     } else {
       ESP_LOGI(TAG, "One UPnP port mapping was added");
     }
+    finish(SUCCESS);
   }
-
-  return SUCCESS;
 }
 
-bool UPnP::getGatewayInfo(gatewayInfo *deviceInfo) {
-  SoftTimer t;
-  while (!connectUDP()) {
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-      ESP_LOGD(TAG, "Timeout expired while connecting UDP");
-      _udpClient.stop();
-      return false;
+// wait for wifi, then check that the internet can be reached
+void UPnP::stepProbe(void) {
+  if (wifi.status() != CONNECTED) {
+    if (expired(_timeoutMs)) {
+      ESP_LOGW(TAG, " ==> Timeout expired while verifying wifi connection");
+      finish(NETWORK_ERROR);
     }
-    delay(500);
+    return;
   }
+  ConnectionPool &pool = ConnectionPool::instance();
+  if (!_tcpClient) {
+    ESP_LOGD(TAG, "Testing internet connection");
+    _tcpClient = pool.acquireAsync(connectivityTestIp, 80);
+    _exchangeStart = millis();
+    if (!_tcpClient) {
+      ESP_LOGW(TAG, "-> Fail");
+      finish(NETWORK_ERROR);
+    }
+    return;
+  }
+  int connected = _tcpClient->connectDone();
+  if (!connected && millis() - _exchangeStart < TCP_CONNECTION_TIMEOUT_MS) {
+    return;
+  }
+  pool.release(_tcpClient, false);
+  _tcpClient = NULL;
+  if (connected <= 0) {
+    ESP_LOGW(TAG, "-> Fail");
+    finish(NETWORK_ERROR);
+    return;
+  }
+  ESP_LOGI(TAG, "-> Success");
 
-  broadcastMSearch();
-  IPAddress gatewayIP = wifi.gatewayIP();
-
-  ESP_LOGD(TAG, "Gateway IP [%s]", gatewayIP.toChar());
+  // get all the needed IGD information using SSDP if we don't have it already
+  if (isGatewayInfoValid(&_gwInfo)) {
+    _currentRule = _headRuleNode;
+    _addedPortMappings = 0;
+    _rulesStart = millis();
+    enterState(UPNP_VERIFY);
+  } else {
+    enterState(UPNP_DISCOVER);
+  }
+}
 
-  t.reset();
-  ssdpDevice *ssdpDevice_ptr = NULL;
-  while ((ssdpDevice_ptr = waitForUnicastResponseToMSearch(gatewayIP)) ==
-         NULL) {
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-      ESP_LOGD(
-          TAG,
-          "Timeout expired while waiting for the gateway router to respond to "
-          "M-SEARCH message");
-      _udpClient.stop();
-      return false;
+// send the M-SEARCH, then wait for the gateway to answer it
+void UPnP::stepDiscover(void) {
+  if (!_requestSent) {
+    if (!connectUDP()) {
+      if (expired(_timeoutMs)) {
+        ESP_LOGD(TAG, "Timeout expired while connecting UDP");
+        finish(NETWORK_ERROR);
+      } else {
+        pause(UPNP_RETRY_MS);
+      }
+      return;
+    }
+    IPAddress gatewayIP = wifi.gatewayIP();
+    ESP_LOGD(TAG, "Gateway IP [%s]", gatewayIP.toChar());
+    if (!startSsdpSearch(gatewayIP)) {
+      finish(NETWORK_ERROR);
+      return;
     }
-    delay(1);
+    broadcastMSearch();
+    _requestSent = true;
+    return;
   }
 
-  deviceInfo->host = ssdpDevice_ptr->host;
-  deviceInfo->port = ssdpDevice_ptr->port;
-  deviceInfo->path = ssdpDevice_ptr->path;
+  if (xSemaphoreTake(_ssdpFound, 0) != pdTRUE) {
+    if (expired(_timeoutMs)) {
+      ESP_LOGD(TAG,
+               "Timeout expired while waiting for the gateway router to "
+               "respond to M-SEARCH message");
+      finish(NETWORK_ERROR);
+    }
+    return;
+  }
+  // close the UDP connection, the callback is done after that
+  _udpClient.stop();
+  ssdpDevice *ssdpDevice_ptr = _ssdpHead->ssdpDevice;
+  _gwInfo.host = ssdpDevice_ptr->host;
+  _gwInfo.port = ssdpDevice_ptr->port;
+  _gwInfo.path = ssdpDevice_ptr->path;
+  ssdpDevice_ptr->path = NULL;  // now _gwInfo's
   // the following is the default and may be overridden if URLBase tag is
   // specified
-  deviceInfo->actionPort = ssdpDevice_ptr->port;
-  // close the UDP connection
-  _udpClient.stop();
+  _gwInfo.actionPort = ssdpDevice_ptr->port;
+  freeSsdpDevices();
+  enterState(UPNP_DESCRIBE);
+}
 
-  t.reset();
-  // connect to IGD (TCP connection)
-  while (!connectToIGD(deviceInfo->host, deviceInfo->port)) {
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
+// drive the HTTP exchange of the current state: connect to the IGD if
+// needed, send the request, then parse the response as it comes in, until
+// TCP_CONNECTION_TIMEOUT_MS after sending it. Returns 1 once it is all in, 0
+// while waiting, -1 if the exchange failed
+int UPnP::stepExchange(int port) {
+  if (!_tcpClient) {
+    _tcpClient = ConnectionPool::instance().acquireAsync(_gwInfo.host, port);
+    _exchangeStart = millis();
+    _requestSent = false;
+    if (!_tcpClient) {
+      ESP_LOGD(TAG, "Could not connect to IGD");
+      return -1;
+    }
+  }
+  int connected = _tcpClient->connectDone();
+  if (connected < 0) {
+    disconnectFromIGD();
+    return -1;
+  }
+  if (!connected) {
+    if (millis() - _exchangeStart >= TCP_CONNECTION_TIMEOUT_MS) {
       ESP_LOGD(TAG, "Timeout expired while trying to connect to the IGD");
-      _tcpClient.close();
-      return false;
+      disconnectFromIGD();
+      return -1;
     }
-    delay(500);
+    return 0;
+  }
+  if (!_requestSent) {
+    if (!sendStateRequest()) {
+      disconnectFromIGD();
+      return -1;
+    }
+    _requestSent = true;
+    _exchangeStart = millis();
+    memset(&_response, 0, sizeof(_response));
+    _response.status = -1;
+    _response.contentLength = -1;
+    return 0;
   }
 
-  t.reset();
-  // get event urls from the gateway IGD
-  while (!getIGDEventURLs(deviceInfo)) {
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-      ESP_LOGD(TAG, "Timeout expired while adding a new port mapping");
-      _tcpClient.close();
-      return false;
+  int done = readResponse();
+  if (done < 0) {
+    ESP_LOGD(TAG, "Invalid response from the IGD");
+    disconnectFromIGD();
+    return -1;
+  }
+  if (!done) {
+    if (millis() - _exchangeStart >= TCP_CONNECTION_TIMEOUT_MS) {
+      ESP_LOGD(TAG, "TCP connection timeout while waiting for the IGD");
+      disconnectFromIGD();
+      return -1;
     }
-    delay(500);
+    return 0;
   }
+  return 1;
+}
 
-  return true;
+bool UPnP::sendStateRequest(void) {
+  upnpRule *rule_ptr = _currentRule ? _currentRule->upnpRule : NULL;
+  switch (_state) {
+    case UPNP_DESCRIBE:
+      return requestDescription(&_gwInfo);
+    case UPNP_VERIFY:
+      ESP_LOGI(TAG, "Verify port mapping for rule [%s]",
+               rule_ptr->devFriendlyName);
+      // fall through
+    case UPNP_CONFIRM:
+      return requestActionOnSpecificPortMapping(
+          &SOAPActionGetSpecificPortMappingEntry, &_gwInfo, rule_ptr);
+    case UPNP_DELETE:
+      return requestActionOnSpecificPortMapping(&SOAPActionDeletePortMapping,
+                                                &_gwInfo, rule_ptr);
+    case UPNP_ADD:
+      return requestAddPortMapping(&_gwInfo, rule_ptr);
+    case UPNP_LIST:
+      return requestGenericPortMappingEntry(&_gwInfo, _listIndex);
+    default:
+      return false;
+  }
+}
+
+// act on the response to the current state's request, received tells if
+// there is one (else the exchange failed)
+void UPnP::handleResponse(bool received) {
+  int status = received ? _response.status : -1;
+  upnpRule *rule_ptr = _currentRule ? _currentRule->upnpRule : NULL;
+  int mapped = 0;
+  bool success;
+
+  switch (_state) {
+    case UPNP_DESCRIBE:
+      if (received && status != 200) {
+        ESP_LOGD(TAG, "Could not get the IGD description");
+      }
+      success = (status == 200) && _response.found;
+      disconnectFromIGD();
+      ESP_LOGD(TAG, "port [%d] actionPort [%d]", _gwInfo.port,
+               _gwInfo.actionPort);
+      if (success && isGatewayInfoValid(&_gwInfo)) {
+        _currentRule = _headRuleNode;
+        _addedPortMappings = 0;
+        enterState(UPNP_VERIFY);
+        // longer delay to allow more time for the router to update its rules
+        pause(1000);
+        _rulesStart = _wakeAt;
+      } else if (expired(_timeoutMs)) {
+        ESP_LOGD(TAG, "ERROR: Invalid router info, cannot continue");
+        finish(NETWORK_ERROR);
+      } else {
+        pause(UPNP_RETRY_MS);  // try again
+      }
+      return;
+
+    case UPNP_VERIFY:
+      // if the IGD couldn't be asked, the rule is added as if not found
+      if (status >= 0) {
+        mapped = portMappingEntry();
+      }
+      disconnectFromIGD();
+      if (mapped > 0) {
+        nextRule();
+        return;
+      }
+      if (mapped < 0) {
+        enterState(UPNP_DELETE);
+        return;
+      }
+      break;  // to add it
+
+    case UPNP_DELETE:
+      if (status < 0 || _response.errorCode || !_response.found) {
+        ESP_LOGD(TAG, "Could not delete the old port mapping");
+      }
+      disconnectFromIGD();
+      break;  // to add it
+
+    case UPNP_ADD:
+      if (status != 200 || _response.errorCode) {
+        ESP_LOGD(TAG, "The IGD didn't accept the port mapping");
+      }
+      disconnectFromIGD();
+      // verify even if it failed: some IGDs report errors and add anyway
+      _tries = 0;
+      enterState(UPNP_CONFIRM);
+      pause(UPNP_SETTLE_MS);
+      return;
+
+    case UPNP_CONFIRM:
+      if (status >= 0) {
+        mapped = portMappingEntry();
+      }
+      disconnectFromIGD();
+      if (mapped > 0) {
+        _addedPortMappings++;
+        ESP_LOGI(TAG, "Port mapping [%s] was added",
+                 rule_ptr->devFriendlyName);
+        nextRule();
+      } else if (++_tries >= UPNP_CONFIRM_TRIES) {
+        finish(VERIFICATION_FAILED);
+      } else {
+        _requestSent = false;
+        pause(UPNP_SETTLE_MS);
+      }
+      return;
+
+    case UPNP_LIST:
+      disconnectFromIGD();
+      if (status < 0) {
+        ESP_LOGD(TAG, "Could not retrieve the port mappings");
+        finish(NETWORK_ERROR);
+      } else if (status == 500 || _response.lastEntry || !_response.found) {
+        if (status == 500) {
+          ESP_LOGD(TAG,
+                   "Internal server error, likely because we have shown all "
+                   "the mappings");
+        }
+        finish(SUCCESS);
+      } else {
+        _listIndex++;
+        enterState(UPNP_LIST);
+        pause(UPNP_LIST_MS);
+      }
+      return;
+
+    default:
+      return;
+  }
+
+  // the current rule needs to be added
+  if (_timeoutMs > 0 && millis() - _rulesStart >= (unsigned long)_timeoutMs) {
+    ESP_LOGD(TAG, "Timeout expired while trying to add a port mapping");
+    finish(TIMEOUT);
+    return;
+  }
+  enterState(UPNP_ADD);
 }
 
 void UPnP::clearGatewayInfo(gatewayInfo *deviceInfo) {
@@ -364,7 +646,7 @@ portMappingResult UPnP::updatePortMappings(unsigned long intervalMs,
 
     if (result == SUCCESS || result == ALREADY_MAPPED) {
       _lastUpdateTime = millis();
-      _tcpClient.close();
+      disconnectFromIGD();
       _consecutiveFails = 0;
       return result;
     } else {
@@ -373,13 +655,13 @@ portMappingResult UPnP::updatePortMappings(unsigned long intervalMs,
                "ERROR: While updating UPnP port mapping. Failed with error "
                "code [%d]",
                result);
-      _tcpClient.close();
+      disconnectFromIGD();
       _consecutiveFails++;
       return result;
     }
   }
 
-  _tcpClient.close();
+  disconnectFromIGD();
   return NOP;  // no need to check yet
 }
 
@@ -389,7 +671,7 @@ bool UPnP::testConnectivity() {
   while (wifi.status() != CONNECTED) {
     if (_timeoutMs > 0 && t.check(_timeoutMs)) {
       ESP_LOGW(TAG, " ==> Timeout expired while verifying wifi connection");
-      _tcpClient.close();
+      disconnectFromIGD();
       return false;
     }
     delay(200);
@@ -398,121 +680,90 @@ bool UPnP::testConnectivity() {
   ESP_LOGD(TAG, "Wifi Connected");  // \n
 
   ESP_LOGD(TAG, "Testing internet connection");
-  _tcpClient.connect(connectivityTestIp, 80);
-  t.reset();
-  while (!_tcpClient.connected()) {
-    if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-      ESP_LOGW(TAG, "-> Fail");
-      _tcpClient.close();
-      return false;
-    }
+  ConnectionPool &pool = ConnectionPool::instance();
+  TCPClient *client =
+      pool.acquire(connectivityTestIp, 80, TCP_CONNECTION_TIMEOUT_MS);
+  if (!client) {
+    ESP_LOGW(TAG, "-> Fail");
+    return false;
   }
 
   ESP_LOGI(TAG, "-> Success");
-  _tcpClient.close();
+  pool.release(client, false);
   return true;
 }
 
-bool UPnP::verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-  if (!applyActionOnSpecificPortMapping(&SOAPActionGetSpecificPortMappingEntry,
-                                        deviceInfo, rule_ptr)) {
-    return false;
-  }
-
-  ESP_LOGD(TAG, "verifyPortMapping called");
-
-  // TODO: extract the current lease duration and return it instead of a bool
-  bool success = false;
-  bool newIP = false;
-  while (_tcpClient.available()) {
-    std::string line = _tcpClient.readUntil('\r');
-    // ESP_LOGD(TAG, "%s", line.c_str());
-    if (line.find("errorCode") != -1) {
-      success = false;
-      // flush response and exit loop
-      while (_tcpClient.available()) {
-        line = _tcpClient.readUntil('\r');
-        // ESP_LOGD(TAG, "%s", line.c_str());
-      }
-      continue;
-    }
-
-    if (line.find("NewInternalClient") != -1) {
-      const char *content = getTagContent(line.c_str(), "NewInternalClient");
-      if (content) {
-        IPAddress ipAddressToVerify = (rule_ptr->internalAddr == ipNull)
-                                          ? wifi.localIP()
-                                          : rule_ptr->internalAddr;
-        if (!strcmp(content, ipAddressToVerify.toChar())) {
-          success = true;
-        } else {
-          newIP = true;
-        }
-      }
-    }
-  }
-
-  _tcpClient.close();
-
-  if (success) {
+// result of a GetSpecificPortMappingEntry: 1 if the rule is mapped to this
+// device, -1 if it is mapped to another IP (this device's changed), 0 if it
+// isn't mapped
+int UPnP::portMappingEntry(void) {
+  // TODO: extract the current lease duration and return it as well
+  if (_response.found && !_response.errorCode) {
     ESP_LOGI(TAG, "Port mapping found in IGD");
-  } else if (newIP) {
+    return 1;
+  }
+  if (_response.otherIP) {
     ESP_LOGI(TAG, "Detected a change in IP");
-    removeAllPortMappingsFromIGD();
-  } else {
-    ESP_LOGI(TAG, "Could not find port mapping in IGD");
+    return -1;
   }
-
-  return success;
+  ESP_LOGI(TAG, "Could not find port mapping in IGD");
+  return 0;
 }
 
-bool UPnP::deletePortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-  if (!applyActionOnSpecificPortMapping(&SOAPActionDeletePortMapping,
-                                        deviceInfo, rule_ptr)) {
-    return false;
-  }
-
-  bool isSuccess = false;
-  while (_tcpClient.available()) {
-    std::string line = _tcpClient.readUntil('\r');
-    // ESP_LOGD(TAG, "%s", line.c_str());
-    if (line.find("errorCode") != -1) {
-      isSuccess = false;
-      // flush response and exit loop
-      while (_tcpClient.available()) {
-        line = _tcpClient.readUntil('\r');
-        // ESP_LOGD(TAG, "%s", line.c_str());
+// one line of the response body, looked at for what the current state's
+// request asked
+void UPnP::parseBodyLine(const char *line) {
+  // ESP_LOGD(TAG, "%s", line);
+  switch (_state) {
+    case UPNP_DESCRIBE:
+      if (_response.status == 200) {
+        parseDescriptionLine(line, &_gwInfo);
       }
-      continue;
+      return;
+    case UPNP_LIST:
+      parseListLine(line);
+      return;
+    default:
+      break;
+  }
+  if (_response.errorCode) {
+    return;  // the rest of the body doesn't matter
+  }
+  if (strstr(line, "errorCode")) {
+    _response.errorCode = true;
+    return;
+  }
+  if (_state == UPNP_DELETE) {
+    if (strstr(line, "DeletePortMappingResponse")) {
+      _response.found = true;
     }
-    if (line.find("DeletePortMappingResponse") != -1) {
-      isSuccess = true;
+    return;
+  }
+  if ((_state == UPNP_VERIFY || _state == UPNP_CONFIRM) &&
+      strstr(line, "NewInternalClient")) {
+    const char *content = getTagContent(line, "NewInternalClient");
+    if (content[0]) {
+      upnpRule *rule_ptr = _currentRule->upnpRule;
+      IPAddress ipAddressToVerify = (rule_ptr->internalAddr == ipNull)
+                                        ? wifi.localIP()
+                                        : rule_ptr->internalAddr;
+      if (!strcmp(content, ipAddressToVerify.toChar())) {
+        _response.found = true;
+      } else {
+        _response.otherIP = true;
+      }
     }
   }
-
-  return isSuccess;
 }
 
-bool UPnP::applyActionOnSpecificPortMapping(SOAPAction *soapAction,
-                                            gatewayInfo *deviceInfo,
-                                            upnpRule *rule_ptr) {
+// send a SOAP action on the rule's external port and protocol to the IGD,
+// over the current connection
+bool UPnP::requestActionOnSpecificPortMapping(SOAPAction *soapAction,
+                                              gatewayInfo *deviceInfo,
+                                              upnpRule *rule_ptr) {
   ESP_LOGD(TAG, "Apply action [%s] on port mapping [%s]", soapAction->name,
            rule_ptr->devFriendlyName);
 
-  // connect to IGD (TCP connection) again, if needed, in case we got
-  // disconnected after the previous query
-  SoftTimer t;
-  if (!_tcpClient.connected()) {
-    while (!connectToIGD(deviceInfo->host, deviceInfo->actionPort)) {
-      if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-        ESP_LOGD(TAG, "Timeout expired while trying to connect to the IGD");
-        _tcpClient.close();
-        return false;
-      }
-      delay(500);
-    }
-  }
-
   strcpy(tmpBody,
          "<?xml version=\"1.0\"?>\r\n<s:Envelope "
          "xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
@@ -535,7 +786,7 @@ bool UPnP::applyActionOnSpecificPortMapping(SOAPAction *soapAction,
 
   sprintf(buffer,
           "POST %s HTTP/1.1\r\n"
-          "Connection: close\r\n"
+          "Connection: keep-alive\r\n"
           "Content-Type: text/xml; charset=\"utf-8\"\r\n"
           "Host: %s:%d\r\n"
           "SOAPAction: \"%s#%s\"\r\n"
@@ -543,29 +794,7 @@ bool UPnP::applyActionOnSpecificPortMapping(SOAPAction *soapAction,
           deviceInfo->actionPath, deviceInfo->host.toChar(),
           deviceInfo->actionPort, deviceInfo->serviceTypeName, soapAction->name,
           strlen(tmpBody));
-  _tcpClient.write(buffer, strlen(buffer));
-  _tcpClient.write(tmpBody,strlen(tmpBody));
-
-  t.reset();
-  while (!_tcpClient.available()) {
-    if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-      ESP_LOGD(TAG, "TCP connection timeout while retrieving port mappings");
-      _tcpClient.close();
-      // TODO: in this case we might not want to add the ports right away
-      // might want to try again or only start adding the ports after we
-      // definitely did not see them in the router list
-      return false;
-    }
-  }
-  return true;
-}
-
-void UPnP::removeAllPortMappingsFromIGD() {
-  upnpRuleNode *currNode = _headRuleNode;
-  while (currNode != NULL) {
-    deletePortMapping(&_gwInfo, currNode->upnpRule);
-    currNode = currNode->next;
-  }
+  return sendRequest(buffer, tmpBody);
 }
 
 // a single try to connect UDP multicast address and port of UPnP
@@ -596,22 +825,18 @@ void UPnP::broadcastMSearch(bool isSsdpAll /*=false*/) {
   }
 
   for (int i = 0; deviceList[i]; i++) {
-    sprintf(tmpBody,
-            "M-SEARCH * HTTP/1.1\r\n"
-            "HOST: 239.255.255.250:%d\r\n"
-            "MAN: \"ssdp:discover\"\r\n"
-            "MX: 2\r\n"  // allowed number of seconds to wait before
-            "ST: %s\r\n"
-            "USER-AGENT: unix/5.1 UPnP/2.0 UPnP/1.0\r\n"
-            "\r\n\r\n",
-            UPNP_SSDP_PORT, deviceList[i]);
-
-    // ESP_LOGD(TAG, "%s", tmpBody);
-    size_t len = strlen(tmpBody);
+    // formatted straight into the datagram
+    int len = _udpClient.printf(
+        "M-SEARCH * HTTP/1.1\r\n"
+        "HOST: 239.255.255.250:%d\r\n"
+        "MAN: \"ssdp:discover\"\r\n"
+        "MX: 2\r\n"  // allowed number of seconds to wait before
+        "ST: %s\r\n"
+        "USER-AGENT: unix/5.1 UPnP/2.0 UPnP/1.0\r\n"
+        "\r\n\r\n",
+        UPNP_SSDP_PORT, deviceList[i]);
     ESP_LOGD(TAG, "M-SEARCH packet length is [%d]", len);
 
-    _udpClient.printf(tmpBody);
-
     int endPacketRes = _udpClient.endPacket();
     ESP_LOGD(TAG, "endPacketRes [%d]", endPacketRes);
   }
@@ -637,49 +862,26 @@ ssdpDeviceNode *UPnP::listSsdpDevices() {
     delay(500);
   }
 
-  broadcastMSearch(true);
   IPAddress gatewayIP = wifi.gatewayIP();
 
   ESP_LOGI(TAG, "Gateway IP [%s]", gatewayIP.toChar());
 
-  ssdpDeviceNode *ssdpDeviceNode_head = NULL;
-  ssdpDeviceNode *ssdpDeviceNode_tail = NULL;
-  ssdpDeviceNode *ssdpDeviceNode_ptr = NULL;
-  ssdpDevice *ssdpDevice_ptr;
-  t.reset();
-  while (true) {
-    ssdpDevice_ptr = waitForUnicastResponseToMSearch(
-        ipNull);  // NULL will cause finding all SSDP device (not just the IGD)
-    if (_timeoutMs > 0 && t.check(_timeoutMs)) {
-      ESP_LOGD(
-          TAG,
-          "Timeout expired while waiting for the gateway router to respond to "
-          "M-SEARCH message");
-      _udpClient.stop();
-      break;
-    }
-
-    ssdpDevicePrint(ssdpDevice_ptr);
-
-    if (ssdpDevice_ptr != NULL) {
-      if (ssdpDeviceNode_head == NULL) {
-        ssdpDeviceNode_head = new ssdpDeviceNode();
-        ssdpDeviceNode_head->ssdpDevice = ssdpDevice_ptr;
-        ssdpDeviceNode_head->next = NULL;
-        ssdpDeviceNode_tail = ssdpDeviceNode_head;
-      } else {
-        ssdpDeviceNode_ptr = new ssdpDeviceNode();
-        ssdpDeviceNode_ptr->ssdpDevice = ssdpDevice_ptr;
-        ssdpDeviceNode_tail->next = ssdpDeviceNode_ptr;
-        ssdpDeviceNode_tail = ssdpDeviceNode_ptr;
-      }
-    }
-
-    delay(5);
+  // ipNull finds all SSDP devices (not just the IGD)
+  if (!startSsdpSearch(ipNull)) {
+    _udpClient.stop();
+    return NULL;
   }
+  broadcastMSearch(true);
+
+  // responses are collected by the callback as they arrive
+  vTaskDelay(pdMS_TO_TICKS(_timeoutMs));
+  ESP_LOGD(TAG, "Done waiting for responses to the M-SEARCH message");
 
-  // close the UDP connection
+  // close the UDP connection, the callback is done after that
   _udpClient.stop();
+  ssdpDeviceNode *ssdpDeviceNode_head = _ssdpHead;
+  ssdpDeviceNode *ssdpDeviceNode_ptr;
+  _ssdpHead = _ssdpTail = NULL;  // now the caller's
 
   // dedup SSDP devices fromt the list - O(n^2)
   ssdpDeviceNode_ptr = ssdpDeviceNode_head;
@@ -692,12 +894,13 @@ ssdpDeviceNode *UPnP::listSsdpDevices() {
               ssdpDeviceNode_ptr->ssdpDevice->host &&
           ssdpDeviceNodeCurr_ptr->ssdpDevice->port ==
               ssdpDeviceNode_ptr->ssdpDevice->port &&
-          ssdpDeviceNodeCurr_ptr->ssdpDevice->path ==
-              ssdpDeviceNode_ptr->ssdpDevice->path) {
+          !strcmp(ssdpDeviceNodeCurr_ptr->ssdpDevice->path,
+                  ssdpDeviceNode_ptr->ssdpDevice->path)) {
         // delete ssdpDeviceNode from the list
         ssdpDeviceNodePrev_ptr->next = ssdpDeviceNodeCurr_ptr->next;
-        free(ssdpDeviceNodeCurr_ptr->ssdpDevice);
-        free(ssdpDeviceNodeCurr_ptr);
+        free(ssdpDeviceNodeCurr_ptr->ssdpDevice->path);
+        delete ssdpDeviceNodeCurr_ptr->ssdpDevice;
+        delete ssdpDeviceNodeCurr_ptr;
         ssdpDeviceNodeCurr_ptr = ssdpDeviceNodePrev_ptr->next;
       } else {
         ssdpDeviceNodePrev_ptr = ssdpDeviceNodeCurr_ptr;
@@ -710,55 +913,75 @@ ssdpDeviceNode *UPnP::listSsdpDevices() {
   return ssdpDeviceNode_head;
 }
 
-// Assuming an M-SEARCH message was broadcaseted, wait for the response from the
-// IGD (Internet Gateway Device) Note: the response from the IGD is sent back as
-// unicast to this device Note: only gateway defined IGD response will be
-// considered, the rest will be ignored
-ssdpDevice *UPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
-  int packetSize = _udpClient.parsePacket();
+// watch for responses to the M-SEARCH message that will be broadcasted
+// (sent back as unicast to this device). Only the IGD's are kept unless
+// gatewayIP is ipNull.
+bool UPnP::startSsdpSearch(IPAddress gatewayIP) {
+  if (!_ssdpFound && !(_ssdpFound = xSemaphoreCreateBinary())) {
+    return false;
+  }
+  xSemaphoreTake(_ssdpFound, 0);
+  freeSsdpDevices();
+  _ssdpGateway = gatewayIP;
+  if (!_udpClient.onPacket(onSsdpPacket, this)) {
+    ESP_LOGD(TAG, "Could not watch the SSDP socket");
+    return false;
+  }
+  return true;
+}
 
-  // only continue if a packet is available
-  if (packetSize <= 0) {
-    return NULL;
+// runs on the reactor task for each datagram
+void UPnP::onSsdpPacket(udpPacket &packet, void *arg) {
+  UPnP *upnp = (UPnP *)arg;
+  ssdpDevice *ssdpDevice_ptr =
+      upnp->parseSsdpResponse(packet, upnp->_ssdpGateway);
+  if (ssdpDevice_ptr == NULL) {
+    return;
   }
+  upnp->ssdpDevicePrint(ssdpDevice_ptr);
+  ssdpDeviceNode *ssdpDeviceNode_ptr = new ssdpDeviceNode();
+  ssdpDeviceNode_ptr->ssdpDevice = ssdpDevice_ptr;
+  ssdpDeviceNode_ptr->next = NULL;
+  if (upnp->_ssdpHead == NULL) {
+    upnp->_ssdpHead = ssdpDeviceNode_ptr;
+  } else {
+    upnp->_ssdpTail->next = ssdpDeviceNode_ptr;
+  }
+  upnp->_ssdpTail = ssdpDeviceNode_ptr;
+  xSemaphoreGive(upnp->_ssdpFound);
+}
+
+void UPnP::freeSsdpDevices(void) {
+  while (_ssdpHead) {
+    ssdpDeviceNode *next = _ssdpHead->next;
+    free(_ssdpHead->ssdpDevice->path);
+    delete _ssdpHead->ssdpDevice;
+    delete _ssdpHead;
+    _ssdpHead = next;
+  }
+  _ssdpTail = NULL;
+}
+
+// the device that answered an M-SEARCH, parsed in place (the datagram is
+// '\0' terminated)
+ssdpDevice *UPnP::parseSsdpResponse(udpPacket &packet,
+                                    IPAddress gatewayIP) {
+  const char *response = (const char *)packet.data;
 
-  IPAddress remoteIP = _udpClient.remoteIP();
   // only continue if the packet was received from the gateway router
   // for SSDP discovery we continue anyway
-  if (gatewayIP != ipNull && remoteIP != gatewayIP) {
+  if (gatewayIP != ipNull && packet.ip != gatewayIP) {
     ESP_LOGD(TAG,
              "Discarded packet not originating from IGD - gatewayIP [%s] "
              "remoteIP [%s]",
-             gatewayIP.toChar(), ipMulti.toChar());
-    return NULL;
-  }
-
-  ESP_LOGD(TAG, "Received packet of size [%d] ip [%s] port [%d]", packetSize,
-           remoteIP.toChar(), _udpClient.remotePort());
-
-  // sanity check
-  if (packetSize > UDP_TX_RESPONSE_MAX_SIZE) {
-    ESP_LOGD(
-        TAG,
-        "Received packet with size larged than the response buffer, cannot "
-        "proceed.");
+             gatewayIP.toChar(), packet.ip.toChar());
     return NULL;
   }
 
-  int idx = 0;
-  while (idx < packetSize) {
-    memset(packetBuffer, 0, UDP_TX_PACKET_MAX_SIZE);
-    int len = _udpClient.read(packetBuffer, UDP_TX_PACKET_MAX_SIZE);
-    if (len <= 0) {
-      break;
-    }
-    ESP_LOGD(TAG, "UDP packet read bytes [%d] out of [%d]", len, packetSize);
-    memcpy(responseBuffer + idx, packetBuffer, len);
-    idx += len;
-  }
-  responseBuffer[idx] = '\0';
+  ESP_LOGD(TAG, "Received packet of size [%d] ip [%s] port [%d]", packet.len,
+           packet.ip.toChar(), packet.port);
 
-  // ESP_LOGD(TAG, "Gateway packet content: %s", responseBuffer);
+  // ESP_LOGD(TAG, "Gateway packet content: %s", response);
 
   const char *const *deviceList = deviceListUpnp;
   if (gatewayIP == ipNull) {
@@ -770,7 +993,7 @@ ssdpDevice *UPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
   if (gatewayIP != ipNull) {  // for the use of listSsdpDevices
     bool foundIGD = false;
     for (int i = 0; deviceList[i]; i++) {
-      if (strstr(responseBuffer, deviceList[i]) != NULL) {
+      if (strstr(response, deviceList[i]) != NULL) {
         foundIGD = true;
         ESP_LOGI(TAG, "IGD of type [%s] found", deviceList[i]);
         break;
@@ -784,21 +1007,19 @@ ssdpDevice *UPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
   }
 
   char *location;
-  char *location_indexStart = strstr(responseBuffer, "location:");
+  const char *location_indexStart = strstr(response, "location:");
   if (location_indexStart == NULL) {
-    location_indexStart = strstr(responseBuffer, "Location:");
+    location_indexStart = strstr(response, "Location:");
   }
   if (location_indexStart == NULL) {
-    location_indexStart = strstr(responseBuffer, "LOCATION:");
+    location_indexStart = strstr(response, "LOCATION:");
   }
   if (location_indexStart != NULL) {
     location_indexStart += 10;  // "location:".length()
-    char *location_indexEnd = strstr(location_indexStart, "\r\n");
+    const char *location_indexEnd = strstr(location_indexStart, "\r\n");
     if (location_indexEnd != NULL) {
       int urlLength = location_indexEnd - location_indexStart;
       int arrLength = urlLength + 1;  // + 1 for '\0'
-      // converting the start index to be inside the packetBuffer rather than
-      // responseBuffer
       location = (char *)malloc(arrLength);
       memcpy(location, location_indexStart, urlLength);
       location[arrLength - 1] = '\0';
@@ -814,22 +1035,33 @@ ssdpDevice *UPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
 
   ESP_LOGD(TAG, "Device location found [%s]", location);
 
-  IPAddress host;
+  // on the heap, this runs on the reactor task: host and path are never
+  // longer than the location
   char port[6];
-  char path[1024];
-  char hostname[256];
   char protocol[30];
+  size_t size = strlen(location) + 1;
+  char *hostname = (char *)malloc(size);
+  char *path = (char *)malloc(size);
+  if (!hostname || !path) {
+    free(hostname);
+    free(path);
+    free(location);
+    return NULL;
+  }
 
   parseUrl(location, protocol, hostname, port, path);
   free(location);
   ssdpDevice *newSsdpDevice_ptr = new ssdpDevice();
 
   if (!newSsdpDevice_ptr) {
+    free(hostname);
+    free(path);
     return NULL;
   }
   newSsdpDevice_ptr->host.fromChar(hostname);
   newSsdpDevice_ptr->port = atoi(port);
-  newSsdpDevice_ptr->path = strdup(path);
+  newSsdpDevice_ptr->path = path;
+  free(hostname);
 
   // ESP_LOGD(TAG,host.toChar());
   // ESP_LOGD(TAG,char *(port));
@@ -838,140 +1070,234 @@ ssdpDevice *UPnP::waitForUnicastResponseToMSearch(IPAddress gatewayIP) {
   return newSsdpDevice_ptr;
 }
 
-// a single trial to connect to the IGD (with TCP)
-bool UPnP::connectToIGD(IPAddress host, int port) {
-  ESP_LOGD(TAG, "Connecting to IGD with host [%s] port [%d]", host.toChar(),
-           port);
-  if (_tcpClient.connect(host, port)) {
-    ESP_LOGD(TAG, "Connected to IGD");
-    return true;
+// send an HTTP request header and its body with a single socket call
+bool UPnP::sendRequest(const char *header, const char *body) {
+  if (!_tcpClient) {
+    return false;
   }
-  return false;
+  _tcpClient->setReadLimit(-1);  // until the response headers tell
+  struct iovec iov[2];
+  iov[0].iov_base = (void *)header;
+  iov[0].iov_len = strlen(header);
+  iov[1].iov_base = (void *)body;
+  iov[1].iov_len = body ? strlen(body) : 0;
+  size_t len = iov[0].iov_len + iov[1].iov_len;
+  return _tcpClient->writev(iov, 2) == (int)len;
 }
 
-// updates deviceInfo with the commands' information of the IGD
-bool UPnP::getIGDEventURLs(gatewayInfo *deviceInfo) {
-  ESP_LOGD(TAG, "called getIGDEventURLs");
+// receive what the IGD has sent of the response so far, without waiting,
+// and parse its complete lines (UPNP_STEP_LINES at most). The reads are
+// bounded to the body so the connection can be reused. Returns 1 once the
+// response is complete, 0 if more is to come, -1 if it isn't a valid one
+int UPnP::readResponse(void) {
+  for (int lines = 0; lines < UPNP_STEP_LINES; lines++) {
+    const char *line;
+    int len = _tcpClient->tryReadLine(line);
+    if (len < 0) {
+      int err = _tcpClient->lastError();
+      if (err == EWOULDBLOCK) {
+        return 0;
+      }
+      if (err) {
+        _keepAlive = false;  // the IGD closed (which may end the body)
+      }
+      return _response.inBody ? 1 : -1;
+    }
+    int textLen = (len && line[len - 1] == '\r') ? len - 1 : len;
+
+    if (_response.status < 0) {
+      int minor = 0;
+      if (sscanf(line, "HTTP/1.%d %d", &minor, &_response.status) != 2) {
+        _response.status = -1;
+        return -1;
+      }
+      _keepAlive = (minor >= 1);  // HTTP/1.0 closes by default
+      continue;
+    }
+
+    if (!_response.inBody) {
+      if (textLen) {
+        parseHeaderLine(line);
+        continue;
+      }
+      // end of headers
+      _response.inBody = true;
+      if (_response.contentLength >= 0 && !_response.chunked) {
+        _tcpClient->setReadLimit(_response.contentLength);
+      } else if (!_response.chunked) {
+        _keepAlive = false;  // the body ends when the IGD closes
+      }
+      ESP_LOGD(TAG,
+               "HTTP status [%d] Content-Length [%d] chunked [%d] keep-alive "
+               "[%d]",
+               _response.status, _response.contentLength, _response.chunked,
+               _keepAlive);
+      continue;
+    }
+
+    if (_response.chunked) {
+      if (_response.lastChunk) {
+        if (!textLen) {
+          _tcpClient->setReadLimit(0);  // end of the trailer and the body
+          return 1;
+        }
+        continue;
+      }
+      if (_response.chunkLeft <= 0) {
+        // chunk size in hex, maybe followed by extensions
+        char *end;
+        long size = strtol(line, &end, 16);
+        if (end == line || size < 0) {
+          return -1;
+        }
+        _response.chunkLeft = size + 2;  // data, then CRLF
+        _response.lastChunk = (size == 0);
+        continue;
+      }
+      _response.chunkLeft -= len + 1;
+      if (_response.chunkLeft <= 0) {
+        // the chunk's CRLF ended the line, it goes on in the next chunk:
+        // keep its start in buffer (free once the request is sent)
+        _response.carryLen += snprintf(
+            buffer + _response.carryLen, sizeof(buffer) - _response.carryLen,
+            "%.*s", textLen, line);
+        _response.carryLen = min(_response.carryLen, (int)sizeof(buffer) - 1);
+        continue;
+      }
+      if (_response.carryLen) {
+        snprintf(buffer + _response.carryLen,
+                 sizeof(buffer) - _response.carryLen, "%s", line);
+        _response.carryLen = 0;
+        line = buffer;
+      }
+    }
+    parseBodyLine(line);
+  }
+  return 0;
+}
+
+void UPnP::parseHeaderLine(const char *line) {
+  if (!strncasecmp(line, "Content-Length:", 15)) {
+    _response.contentLength = atoi(line + 15);
+  } else if (!strncasecmp(line, "Transfer-Encoding:", 18)) {
+    _response.chunked = (strcasestr(line + 18, "chunked") != NULL);
+  } else if (!strncasecmp(line, "Connection:", 11)) {
+    if (strcasestr(line + 11, "close")) {
+      _keepAlive = false;
+    } else if (strcasestr(line + 11, "keep-alive")) {
+      _keepAlive = true;
+    }
+  }
+}
+
+// hand the connection back to the pool, which keeps it open if the IGD
+// allows it and the last response was read entirely
+void UPnP::disconnectFromIGD() {
+  if (_tcpClient) {
+    tcpStats stats;
+    if (_tcpClient->getStats(stats)) {
+      ESP_LOGD(TAG,
+               "IGD connection: connect %lu us, first byte %lu us, rtt %lu "
+               "us over %lu exchanges, %lu bytes in, %lu bytes out",
+               (unsigned long)stats.connectUs, (unsigned long)stats.firstByteUs,
+               (unsigned long)stats.rttUs, (unsigned long)stats.rttSamples,
+               (unsigned long)stats.bytesIn, (unsigned long)stats.bytesOut);
+    }
+    ConnectionPool::instance().release(_tcpClient, _keepAlive);
+    _tcpClient = NULL;
+  }
+  _keepAlive = false;
+}
+
+// ask the IGD for its description, over the current connection
+bool UPnP::requestDescription(gatewayInfo *deviceInfo) {
+  ESP_LOGD(TAG, "called requestDescription");
   ESP_LOGD(TAG, "deviceInfo->actionPath [%s] deviceInfo->path [%s]",
            deviceInfo->actionPath, deviceInfo->path);
 
   // make an HTTP request
   sprintf(buffer,
       "GET %s HTTP/1.1\r\n"
+      "Connection: keep-alive\r\n"
       "Content-Type: text/xml; charset=\"utf-8\"\r\n"
       "Host: %s:%d\r\n"
       "Content-Length: 0\r\n\r\n",
       deviceInfo->path, deviceInfo->host.toChar(), deviceInfo->actionPort);
 
-  _tcpClient.write(buffer, strlen(buffer));
+  return sendRequest(buffer);
+}
 
-  SoftTimer t;
-  // wait for the response
-  while (_tcpClient.available() == 0) {
-    if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-      ESP_LOGD(TAG, "TCP connection timeout while executing getIGDEventURLs");
-      _tcpClient.close();
-      return false;
+// updates deviceInfo with the commands' information of the IGD, from a line
+// of the body of its description
+void UPnP::parseDescriptionLine(const char *line, gatewayInfo *deviceInfo) {
+  if (_response.found) {
+    return;  // the rest of the description isn't needed
+  }
+  const char *line_ptr = line;
+  if (!_response.urlBaseFound && strstr(line, "<URLBase>")) {
+    // e.g. <URLBase>http://192.168.1.1:5432/</URLBase>
+    // Note: assuming URL path will only be found in a specific action under
+    // the 'controlURL' xml tag
+    char *baseUrl = strdup(getTagContent(line, "URLBase"));
+    if (strlen(baseUrl) > 0) {
+      trim(baseUrl);
+      IPAddress host = getHost(baseUrl);  // this is ignored, assuming router
+                                          // host IP will not change
+      int port = getPort(baseUrl);
+      deviceInfo->actionPort = port;
+
+      ESP_LOGD(TAG,"URLBase tag found [%s]", baseUrl);
+      ESP_LOGD(TAG, "Translated to base host [%s] and base port [%d]",
+               host.toChar(), port);
+      _response.urlBaseFound = true;
     }
+    free(baseUrl);
   }
 
-  // read all the lines of the reply from server
-  bool upnpServiceFound = false;
-  bool urlBaseFound = false;
-  std::string line;
-  while (_tcpClient.available()) {
-    line = _tcpClient.readUntil('\r');
-    int index_in_line = 0;
-    if (!urlBaseFound && line.find("<URLBase>") != -1) {
-      // e.g. <URLBase>http://192.168.1.1:5432/</URLBase>
-      // Note: assuming URL path will only be found in a specific action under
-      // the 'controlURL' xml tag
-      char *baseUrl = strdup(getTagContent(line.c_str(), "URLBase"));
-      if (strlen(baseUrl) > 0) {
-        trim(baseUrl);
-        IPAddress host = getHost(baseUrl);  // this is ignored, assuming router
-                                            // host IP will not change
-        int port = getPort(baseUrl);
-        deviceInfo->actionPort = port;
-
-        ESP_LOGD(TAG,"URLBase tag found [%s]", baseUrl);
-        ESP_LOGD(TAG, "Translated to base host [%s] and base port [%d]",
-                 host.toChar(), port);
-        urlBaseFound = true;
-      }
+  // to support multiple <serviceType> tags
+  const char *service_type_start = NULL;
+
+  for (int i = 0; deviceListUpnp[i]; i++) {
+    char serviceTag[100];
+    sprintf(serviceTag, "%s%s", UPNP_SERVICE_TYPE_TAG_START,
+            deviceListUpnp[i]);
+    const char *service_type_end = NULL;
+    service_type_start = strstr(line, serviceTag);
+    if (service_type_start) {
+      ESP_LOGD(TAG, "[%s] service_type_index [%d]",
+               deviceInfo->serviceTypeName, service_type_start - line);
+      service_type_end =
+          strstr(service_type_start, UPNP_SERVICE_TYPE_TAG_END);
     }
-
-    // to support multiple <serviceType> tags
-    int service_type_index_start = 0;
-
-    for (int i = 0; deviceListUpnp[i]; i++) {
-      char serviceTag[100];
-      sprintf(serviceTag, "%s%s", UPNP_SERVICE_TYPE_TAG_START,
-              deviceListUpnp[i]);
-      int service_type_index =
-          line.find(serviceTag);
-      if (service_type_index >= 0) {
-        ESP_LOGD(TAG, "[%s] service_type_index [%d]",
-                 deviceInfo->serviceTypeName, service_type_index);
-        service_type_index_start = service_type_index;
-        service_type_index =
-            line.find(UPNP_SERVICE_TYPE_TAG_END, service_type_index_start);
-      }
-      if (!upnpServiceFound && service_type_index >= 0) {
-        index_in_line += service_type_index;
-        upnpServiceFound = true;
-        deviceInfo->serviceTypeName = strdup(getTagContent(
-            line.substr(service_type_index_start).c_str(), UPNP_SERVICE_TYPE_TAG_NAME));
-        ESP_LOGD(TAG, "[%s] service found! deviceType [%s]",
-                 deviceInfo->serviceTypeName, deviceListUpnp[i]);
-        break;  // will start looking for 'controlURL' now
-      }
+    if (!_response.serviceFound && service_type_end) {
+      line_ptr = service_type_end;
+      _response.serviceFound = true;
+      deviceInfo->serviceTypeName = strdup(
+          getTagContent(service_type_start, UPNP_SERVICE_TYPE_TAG_NAME));
+      ESP_LOGD(TAG, "[%s] service found! deviceType [%s]",
+               deviceInfo->serviceTypeName, deviceListUpnp[i]);
+      break;  // will start looking for 'controlURL' now
     }
+  }
 
-    if (upnpServiceFound &&
-        (index_in_line = line.find("<controlURL>", index_in_line)) >= 0) {
-      const char *controlURLContent =
-          getTagContent(line.substr(index_in_line).c_str(), "controlURL");
-      if (strlen(controlURLContent) > 0) {
-        deviceInfo->actionPath = strdup(controlURLContent);
-
-        ESP_LOGD(TAG, "controlURL tag found! setting actionPath to [%s]",
-                 controlURLContent);
+  if (_response.serviceFound &&
+      (line_ptr = strstr(line_ptr, "<controlURL>")) != NULL) {
+    const char *controlURLContent = getTagContent(line_ptr, "controlURL");
+    if (strlen(controlURLContent) > 0) {
+      deviceInfo->actionPath = strdup(controlURLContent);
 
-        // clear buffer
-        ESP_LOGD(TAG, "Flushing the rest of the response");
-        while (_tcpClient.available()) {
-          _tcpClient.read();
-        }
+      ESP_LOGD(TAG, "controlURL tag found! setting actionPath to [%s]",
+               controlURLContent);
 
-        // now we have (upnpServiceFound && controlURLFound)
-        return true;
-      }
+      // now we have (upnpServiceFound && controlURLFound)
+      _response.found = true;
     }
   }
-
-  return false;
 }
 
-// assuming a connection to the IGD has been formed
-// will add the port mapping to the IGD
-bool UPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
-  ESP_LOGD(TAG, "called addPortMappingEntry");
-
-
-  // connect to IGD (TCP connection) again, if needed, in case we got
-  // disconnected after the previous query
-  SoftTimer t;
-  if (!_tcpClient.connected()) {
-    while (!connectToIGD(_gwInfo.host, _gwInfo.actionPort)) {
-      if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-        ESP_LOGD(TAG, "Timeout expired while trying to connect to the IGD");
-        _tcpClient.close();
-        return false;
-      }
-      delay(500);
-    }
-  }
+// ask the IGD to add the port mapping, over the current connection
+bool UPnP::requestAddPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
+  ESP_LOGD(TAG, "called requestAddPortMapping");
 
   ESP_LOGD(TAG, "deviceInfo->actionPath [%s]", deviceInfo->actionPath);
 
@@ -1010,6 +1336,7 @@ bool UPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
   // printf(tmpBody);
   sprintf(buffer,
           "POST %s HTTP/1.1\r\n"
+          "Connection: keep-alive\r\n"
           "Content-Type: text/xml; charset=\"utf-8\"\r\n"
           "Host: %s:%d\r\n"
           "SOAPAction: \"%s#AddPortMapping\"\r\n"
@@ -1017,178 +1344,108 @@ bool UPnP::addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr) {
           deviceInfo->actionPath, deviceInfo->host.toChar(),
           deviceInfo->actionPort, deviceInfo->serviceTypeName, strlen(tmpBody));
 
-  _tcpClient.write(buffer, strlen(buffer));
-  _tcpClient.write(tmpBody,strlen(tmpBody));
-
   ESP_LOGD(TAG, "Content-Length was: %d", strlen(tmpBody));
-
-  t.reset();
-  while (_tcpClient.available() == 0) {
-    if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-      ESP_LOGD(TAG, "TCP connection timeout while adding a port mapping");
-      _tcpClient.close();
-      return false;
-    }
-  }
-
-  // TODO: verify success
-  bool isSuccess = true;
-  while (_tcpClient.available()) {
-    std::string line = _tcpClient.readUntil('\r');
-    if (line.find("errorCode") != -1) {
-      isSuccess = false;
-    }
-    // ESP_LOGD(TAG, "%s", line.c_str());
-  }
-
-  if (!isSuccess) {
-    _tcpClient.close();
-  }
-
-  return isSuccess;
+  return sendRequest(buffer, tmpBody);
 }
 
+/**
+ * @brief log the port mappings found in the IGD, blocking until it's done
+ * (see startPortMappingList() to do it in the background)
+ *
+ * @return true all of them were listed
+ * @return false a run is in progress, the IGD isn't known yet or it couldn't
+ * be reached
+ */
 bool UPnP::printAllPortMappings() {
-  // verify gateway information is valid
-  // TODO: use this _gwInfo to skip the UDP part completely if it is not empty
-  if (!isGatewayInfoValid(&_gwInfo)) {
-    ESP_LOGD(TAG, "Invalid router info, cannot continue");
+  if (!startPortMappingList()) {
     return false;
   }
+  while (busy()) {
+    step();
+    vTaskDelay(pdMS_TO_TICKS(UPNP_STEP_MS));
+  }
+  return _result == SUCCESS;
+}
 
-  upnpRuleNode *ruleNodeHead_ptr = NULL;
-  upnpRuleNode *ruleNodeTail_ptr = NULL;
-
-  bool reachedEnd = false;
-  int index = 0;
-  SoftTimer t;
-  while (!reachedEnd) {
-    // connect to IGD (TCP connection) again, if needed, in case we got
-    // disconnected after the previous query
-    if (!_tcpClient.connected()) {
-      while (!connectToIGD(_gwInfo.host, _gwInfo.actionPort)) {
-        if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-          ESP_LOGD(TAG, "Timeout expired while trying to connect to the IGD");
-          _tcpClient.close();
-          return false;
-        }
-        delay(1000);
-      }
-    }
+// ask the IGD for its port mapping at index, over the current connection
+bool UPnP::requestGenericPortMappingEntry(gatewayInfo *deviceInfo,
+                                          int index) {
+  ESP_LOGD(TAG, "Sending query for index [%d]", index);
+
+  strcpy(
+      tmpBody,
+          "<?xml version=\"1.0\"?>"
+          "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+          "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+          "<s:Body>"
+          "<u:GetGenericPortMappingEntry xmlns:u=\"");
+  strcat(tmpBody, deviceInfo->serviceTypeName);
+  strcat(tmpBody, "\"><NewPortMappingIndex>");
 
-    ESP_LOGD(TAG, "Sending query for index [%d]", index);
-
-    strcpy(
-        tmpBody,
-            "<?xml version=\"1.0\"?>"
-            "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
-            "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
-            "<s:Body>"
-            "<u:GetGenericPortMappingEntry xmlns:u=\"");
-    strcat(tmpBody, _gwInfo.serviceTypeName);
-    strcat(tmpBody, "\"><NewPortMappingIndex>");
-
-    sprintf(integerString, "%d", index);
-    strcat(tmpBody, integerString);
-    strcat(tmpBody, "</NewPortMappingIndex>"
-                         "</u:GetGenericPortMappingEntry>"
-                         "</s:Body>"
-                         "</s:Envelope>");
-
-    // printf(tmpBody);
-
-    sprintf(buffer,
-            "POST %s HTTP/1.1\r\n"
-            "Connection: keep-alive\r\n"
-            "Content-Type: text/xml; charset=\"utf-8\"\r\n"
-            "Host: %s:%d\r\n"
-            "SOAPAction: \"%s#GetGenericPortMappingEntry\"\r\n"
-            "Content-Length: %d\r\n\r\n",
-            _gwInfo.actionPath, _gwInfo.host.toChar(), _gwInfo.actionPort,
-            _gwInfo.serviceTypeName, strlen(tmpBody));
-    _tcpClient.write(buffer, strlen(buffer));
-    _tcpClient.write(tmpBody,strlen(tmpBody));
-
-    t.reset();
-    while (_tcpClient.available() == 0) {
-      if (t.check(TCP_CONNECTION_TIMEOUT_MS)) {
-        ESP_LOGD(TAG, "TCP connection timeout while retrieving port mappings");
-        _tcpClient.close();
-        reachedEnd = true;
-        break;
-      }
-    }
+  sprintf(integerString, "%d", index);
+  strcat(tmpBody, integerString);
+  strcat(tmpBody, "</NewPortMappingIndex>"
+                       "</u:GetGenericPortMappingEntry>"
+                       "</s:Body>"
+                       "</s:Envelope>");
 
-    std::string line = "";
-    upnpRule *rule_ptr = NULL;
-    while (_tcpClient.available()) {
-      line = _tcpClient.readUntil('\r');
-      // ESP_LOGD(TAG, "%s", line.c_str());
-      if (line.find(PORT_MAPPING_INVALID_INDEX) != -1) {
-        reachedEnd = true;
-      } else if (line.find(PORT_MAPPING_INVALID_ACTION) != -1) {
-        ESP_LOGD(TAG, "Invalid action while reading port mappings");
-        reachedEnd = true;
-      } else if (line.find("HTTP/1.1 500 ") != -1) {
-        ESP_LOGD(TAG,
-                 "Internal server error, likely because we have shown all the "
-                 "mappings");
-        reachedEnd = true;
-      } else if (line.find("GetGenericPortMappingEntryResponse") != -1) {
-        rule_ptr = new upnpRule();
-        rule_ptr->index = index;
-      } else if (line.find("NewPortMappingDescription") != - 1) {
-        rule_ptr->devFriendlyName =
-            strdup(getTagContent(line.c_str(), "NewPortMappingDescription"));
-      } else if (line.find("NewInternalClient") != -1) {
-        const char *newInternalClient = getTagContent(line.c_str(), "NewInternalClient");
-        if (!newInternalClient[0]) {
-          continue;
-        }
-        rule_ptr->internalAddr.fromChar(newInternalClient);
-      } else if (line.find("NewInternalPort") != -1) {
-        rule_ptr->internalPort = atoi(getTagContent(line.c_str(), "NewInternalPort"));
-      } else if (line.find("NewExternalPort") != -1) {
-        rule_ptr->externalPort =
-            atoi(getTagContent(line.c_str(), "NewExternalPort"));
-      } else if (line.find("NewProtocol") != -1) {
-        rule_ptr->protocol = strdup(getTagContent(line.c_str(), "NewProtocol"));
-      } else if (line.find("NewLeaseDuration") != -1) {
-        rule_ptr->leaseDuration =
-            atoi(getTagContent(line.c_str(), "NewLeaseDuration"));
-
-        upnpRuleNode *currRuleNode_ptr = new upnpRuleNode();
-        currRuleNode_ptr->upnpRule = rule_ptr;
-        currRuleNode_ptr->next = NULL;
-        if (ruleNodeHead_ptr == NULL) {
-          ruleNodeHead_ptr = currRuleNode_ptr;
-          ruleNodeTail_ptr = currRuleNode_ptr;
-        } else {
-          ruleNodeTail_ptr->next = currRuleNode_ptr;
-          ruleNodeTail_ptr = currRuleNode_ptr;
-        }
-      }
-    }
+  // printf(tmpBody);
 
-    index++;
-    delay(250);
-  }
+  sprintf(buffer,
+          "POST %s HTTP/1.1\r\n"
+          "Connection: keep-alive\r\n"
+          "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+          "Host: %s:%d\r\n"
+          "SOAPAction: \"%s#GetGenericPortMappingEntry\"\r\n"
+          "Content-Length: %d\r\n\r\n",
+          deviceInfo->actionPath, deviceInfo->host.toChar(),
+          deviceInfo->actionPort, deviceInfo->serviceTypeName,
+          strlen(tmpBody));
+  return sendRequest(buffer, tmpBody);
+}
 
-  // print nicely and free heap memory
-  ESP_LOGD(TAG, "IGD current port mappings:");
-  upnpRuleNode *curr_ptr = ruleNodeHead_ptr;
-  upnpRuleNode *del_prt = ruleNodeHead_ptr;
-  while (curr_ptr != NULL) {
-    upnpRulePrint(curr_ptr->upnpRule);
-    del_prt = curr_ptr;
-    curr_ptr = curr_ptr->next;
-    delete del_prt->upnpRule;
-    delete del_prt;
+// a line of a GetGenericPortMappingEntry response: the entry is logged once
+// its last field is in
+void UPnP::parseListLine(const char *line) {
+  upnpRule *rule_ptr = &_listRule;
+  if (strstr(line, PORT_MAPPING_INVALID_INDEX)) {
+    _response.lastEntry = true;
+  } else if (strstr(line, PORT_MAPPING_INVALID_ACTION)) {
+    ESP_LOGD(TAG, "Invalid action while reading port mappings");
+    _response.lastEntry = true;
+  } else if (strstr(line, "GetGenericPortMappingEntryResponse")) {
+    if (_response.found) {
+      return;  // its closing tag
+    }
+    _response.found = true;
+    free(rule_ptr->devFriendlyName);
+    free(rule_ptr->protocol);
+    *rule_ptr = {};
+    rule_ptr->index = _listIndex;
+    rule_ptr->devFriendlyName = strdup("");
+    rule_ptr->protocol = strdup("");
+  } else if (!_response.found) {
+    return;
+  } else if (strstr(line, "NewPortMappingDescription")) {
+    free(rule_ptr->devFriendlyName);
+    rule_ptr->devFriendlyName =
+        strdup(getTagContent(line, "NewPortMappingDescription"));
+  } else if (strstr(line, "NewInternalClient")) {
+    const char *newInternalClient = getTagContent(line, "NewInternalClient");
+    if (newInternalClient[0]) {
+      rule_ptr->internalAddr.fromChar(newInternalClient);
+    }
+  } else if (strstr(line, "NewInternalPort")) {
+    rule_ptr->internalPort = atoi(getTagContent(line, "NewInternalPort"));
+  } else if (strstr(line, "NewExternalPort")) {
+    rule_ptr->externalPort = atoi(getTagContent(line, "NewExternalPort"));
+  } else if (strstr(line, "NewProtocol")) {
+    free(rule_ptr->protocol);
+    rule_ptr->protocol = strdup(getTagContent(line, "NewProtocol"));
+  } else if (strstr(line, "NewLeaseDuration")) {
+    rule_ptr->leaseDuration = atoi(getTagContent(line, "NewLeaseDuration"));
+    upnpRulePrint(rule_ptr);
   }
-
-  _tcpClient.close();
-
-  return true;
 }
 
 void UPnP::printPortMappingConfig() {
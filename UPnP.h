@@ -28,14 +28,23 @@
 #ifndef __UPNP_H_
 #define __UPNP_H_
 
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "IPAddress.h"
 #include "utils.h"
 #include "TCPClient.h"
+#include "ConnectionPool.h"
 #include "UDPClient.h"
 
 #define UPNP_DEBUG
 #define UPNP_SSDP_PORT 1900
 #define TCP_CONNECTION_TIMEOUT_MS 6000
+#define UPNP_STEP_MS 10        // step() period of commitPortMappings()
+#define UPNP_RETRY_MS 500      // between attempts to reach the IGD
+#define UPNP_SETTLE_MS 2000    // for the IGD to apply a new rule
+#define UPNP_CONFIRM_TRIES 4   // verifications after adding a rule
+#define UPNP_LIST_MS 250       // between GetGenericPortMappingEntry requests
+#define UPNP_STEP_LINES 32     // response lines parsed per step() at most
 #define PORT_MAPPING_INVALID_INDEX \
   "<errorDescription>SpecifiedArrayIndexInvalid</errorDescription>"
 #define PORT_MAPPING_INVALID_ACTION \
@@ -48,11 +57,6 @@
   6  // after 6 tries of updatePortMappings we will execute the more extensive
      // addPortMapping
 
-#define UDP_TX_PACKET_MAX_SIZE \
-  1000  // reduce max UDP packet size to conserve memory (by default
-        // UDP_TX_PACKET_MAX_SIZE=8192)
-#define UDP_TX_RESPONSE_MAX_SIZE 8192
-
 // TODO: idealy the SOAP actions should be verified as supported by the IGD
 // before they are used 		 a struct can be created for each action and filled when
 // the XML descriptor file is read
@@ -132,6 +136,40 @@ typedef enum {
   NOP  // the check is delayed
 } portMappingResult;
 
+// where a port mapping run started by startPortMappings() is
+typedef enum {
+  UPNP_IDLE = 0,
+  UPNP_PROBE,     // waiting for wifi, then testing the internet connection
+  UPNP_DISCOVER,  // M-SEARCH sent, waiting for the IGD to answer
+  UPNP_DESCRIBE,  // fetching the IGD description for its control URL
+  UPNP_VERIFY,    // is the current rule already mapped?
+  UPNP_DELETE,    // the rule points to another IP, remove it first
+  UPNP_ADD,       // AddPortMapping for the current rule
+  UPNP_CONFIRM,   // verifying it again, UPNP_SETTLE_MS after adding it
+  UPNP_LIST,      // GetGenericPortMappingEntry, see startPortMappingList()
+} upnpState;
+
+// the IGD's response to the current request, parsed line by line as it
+// comes in (see readResponse())
+typedef struct _upnpResponse {
+  int status;         // HTTP status, -1 until the status line is in
+  int contentLength;  // -1 if not given
+  bool inBody;
+  bool chunked;       // Transfer-Encoding: chunked
+  long chunkLeft;     // bytes of the current chunk and its CRLF not read yet
+  bool lastChunk;     // the trailer of a chunked body comes next
+  int carryLen;       // of a line split by a chunk boundary, see readResponse()
+  bool errorCode;     // the IGD reported a SOAP error
+  bool found;         // the body has what the request asked for
+  bool otherIP;       // GetSpecificPortMappingEntry: mapped to another IP
+  bool serviceFound;  // description: WAN*Connection service found
+  bool urlBaseFound;  // description: <URLBase> found
+  bool lastEntry;     // GetGenericPortMappingEntry: no mapping at this index
+} upnpResponse;
+
+// called from step() when a run is over
+typedef void (*upnp_result_callback)(portMappingResult result, void *arg);
+
 class UPnP {
  public:
   UPnP(unsigned long timeoutMs = 20000UL);
@@ -143,10 +181,15 @@ class UPnP {
                             const char * ruleProtocol, int ruleLeaseDuration,
                             const char * ruleFriendlyName);
   portMappingResult commitPortMappings();
+  bool startPortMappings(upnp_result_callback callback = NULL,
+                         void *arg = NULL);
+  void step(void);
+  bool busy(void);
   portMappingResult updatePortMappings(
       unsigned long intervalMs,
       callback_function fallback = NULL /* optional */);
   bool printAllPortMappings();
+  bool startPortMappingList(void);
   void printPortMappingConfig();  // prints all the port mappings that were
                                   // added using `addPortMappingConfig`
   bool testConnectivity();
@@ -161,19 +204,36 @@ class UPnP {
  private:
   bool connectUDP();
   void broadcastMSearch(bool isSsdpAll = false);
-  ssdpDevice *waitForUnicastResponseToMSearch(IPAddress gatewayIP);
-  bool getGatewayInfo(gatewayInfo *deviceInfo);
+  bool startSsdpSearch(IPAddress gatewayIP);
+  static void onSsdpPacket(udpPacket &packet, void *arg);
+  ssdpDevice *parseSsdpResponse(udpPacket &packet, IPAddress gatewayIP);
+  void freeSsdpDevices(void);
   bool isGatewayInfoValid(gatewayInfo *deviceInfo);
   void clearGatewayInfo(gatewayInfo *deviceInfo);
-  bool connectToIGD(IPAddress host, int port);
-  bool getIGDEventURLs(gatewayInfo *deviceInfo);
-  bool addPortMappingEntry(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
-  bool verifyPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
-  bool deletePortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
-  bool applyActionOnSpecificPortMapping(SOAPAction *soapAction,
-                                           gatewayInfo *deviceInfo,
-                                           upnpRule *rule_ptr);
-  void removeAllPortMappingsFromIGD();
+  void disconnectFromIGD(void);
+  bool sendRequest(const char *header, const char *body = NULL);
+  int readResponse(void);
+  void parseHeaderLine(const char *line);
+  void parseBodyLine(const char *line);
+  bool requestDescription(gatewayInfo *deviceInfo);
+  void parseDescriptionLine(const char *line, gatewayInfo *deviceInfo);
+  bool requestAddPortMapping(gatewayInfo *deviceInfo, upnpRule *rule_ptr);
+  bool requestActionOnSpecificPortMapping(SOAPAction *soapAction,
+                                          gatewayInfo *deviceInfo,
+                                          upnpRule *rule_ptr);
+  int portMappingEntry(void);
+  bool requestGenericPortMappingEntry(gatewayInfo *deviceInfo, int index);
+  void parseListLine(const char *line);
+  void enterState(upnpState state);
+  void pause(unsigned long ms);
+  bool expired(unsigned long ms);
+  void finish(portMappingResult result);
+  void nextRule(void);
+  void stepProbe(void);
+  void stepDiscover(void);
+  int stepExchange(int port);
+  bool sendStateRequest(void);
+  void handleResponse(bool received);
 
   void upnpRulePrint(upnpRule *rule_ptr);
   // char * getSpaceschar *(int num);
@@ -188,8 +248,30 @@ class UPnP {
   unsigned long _lastUpdateTime;
   long _timeoutMs;  // 0 for blocking operation
   UDPClient _udpClient;
-  TCPClient _tcpClient;
+  // SSDP responses, collected on the reactor task
+  ssdpDeviceNode *_ssdpHead;
+  ssdpDeviceNode *_ssdpTail;
+  IPAddress _ssdpGateway;        // only the IGD's, ipNull for all
+  SemaphoreHandle_t _ssdpFound;  // given for each device found
+  TCPClient *_tcpClient;  // borrowed from the connection pool
+  bool _keepAlive;        // the IGD keeps the connection open
   unsigned long _consecutiveFails;
+  // port mapping run, see step()
+  upnpState _state;
+  portMappingResult _result;
+  upnp_result_callback _resultCallback;
+  void *_resultArg;
+  upnpRuleNode *_currentRule;
+  unsigned long _stateStart;     // millis() when _state was entered
+  unsigned long _rulesStart;     // millis() when the first rule was verified
+  unsigned long _exchangeStart;  // millis() at connection, then request
+  unsigned long _wakeAt;         // step() does nothing until then
+  bool _requestSent;
+  upnpResponse _response;
+  int _tries;
+  int _addedPortMappings;
+  int _listIndex;      // of the IGD's port mapping being listed
+  upnpRule _listRule;  // that port mapping, as it is parsed
   char buffer[2048];
   char temp[255];
 };
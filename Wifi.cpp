@@ -583,17 +583,25 @@ void Wifi::addPortMappingConfig(int rulePort, const char *ruleProtocol,
   mappingTestCnt = 0;
 }
 
+// called from the wifi task loop: starts a port mapping run every 30 s while
+// mappings are pending and moves the current one forward, without blocking
 void Wifi::checkUPnPMappings(void) {
-  if (newMapping && upnpTimer.check(30000UL)) {
-    portMappingResult portMappingAdded;
-    portMappingAdded = upnp.commitPortMappings();
-    mappingTestCnt++;
-
-    if (portMappingAdded == SUCCESS || portMappingAdded == ALREADY_MAPPED ||
-        mappingTestCnt > 3) {
-      newMapping = false;
-      upnp.printAllPortMappings();
-    }
+  ConnectionPool::instance().evictIdle();
+  if (newMapping && !upnp.busy() && upnpTimer.check(30000UL)) {
+    upnpTimer.reset();
+    upnp.startPortMappings(onPortMappings, this);
+  }
+  upnp.step();
+}
+
+void Wifi::onPortMappings(portMappingResult result, void *arg) {
+  Wifi *self = (Wifi *)arg;
+  self->mappingTestCnt++;
+  if (result == SUCCESS || result == ALREADY_MAPPED ||
+      self->mappingTestCnt > 3) {
+    self->newMapping = false;
+    // listed by the next step() calls, like the run that just ended
+    self->upnp.startPortMappingList();
   }
 }
 
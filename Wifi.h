@@ -117,6 +117,7 @@ class Wifi {
   Config *config;
 
  private:
+  static void onPortMappings(portMappingResult result, void *arg);
   static Wifi *_instance;
   EventGroupHandle_t _wifiEventGroup;
 
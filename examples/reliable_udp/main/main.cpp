@@ -0,0 +1,90 @@
+#include <stdio.h>
+
+#include "ReliableUDP.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Loss-injection test for ReliableUDP: two ends over 127.0.0.1 (no radio
+// involved), each dropping a share of its outgoing datagrams, data and
+// ACKs. Every record must arrive once, in order.
+
+#define SENDER_PORT 8091
+#define RECEIVER_PORT 8092
+#define RECORD_COUNT 5000
+#define RECORD_MAX 200
+
+#ifdef __cplusplus
+extern "C" {
+void app_main(void);
+}
+#endif
+
+static const char *TAG = "ReliableUDP test";
+
+static volatile uint32_t expected = 0;
+static volatile uint32_t errors = 0;
+
+// records carry their number and are 4 + number % RECORD_MAX bytes long
+static void onRecord(const uint8_t *data, size_t len, void *arg) {
+  uint32_t number;
+  memcpy(&number, data, sizeof(number));
+  if (number != expected || len != sizeof(number) + number % RECORD_MAX) {
+    ESP_LOGE(TAG, "Got record %lu (%d bytes), expected %lu", number, len,
+             expected);
+    errors = errors + 1;
+  }
+  expected = number + 1;
+}
+
+static bool runTest(uint8_t lossRate) {
+  ReliableUDP sender, receiver;
+  IPAddress loopback(127, 0, 0, 1);
+  if (!sender.begin(SENDER_PORT, loopback, RECEIVER_PORT, NULL) ||
+      !receiver.begin(RECEIVER_PORT, loopback, SENDER_PORT, onRecord)) {
+    ESP_LOGE(TAG, "Could not start");
+    return false;
+  }
+  sender.setLossRate(lossRate);
+  receiver.setLossRate(lossRate);
+  expected = 0;
+  errors = 0;
+
+  uint8_t record[sizeof(uint32_t) + RECORD_MAX];
+  memset(record, 0xaa, sizeof(record));
+  int64_t start = esp_timer_get_time();
+  for (uint32_t i = 0; i < RECORD_COUNT; i++) {
+    memcpy(record, &i, sizeof(i));
+    if (!sender.send(record, sizeof(i) + i % RECORD_MAX)) {
+      ESP_LOGE(TAG, "Could not send record %lu", i);
+      return false;
+    }
+  }
+  bool flushed = sender.flush(10000);
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  rudpStats stats;
+  sender.getStats(stats);
+  bool passed = flushed && expected == RECORD_COUNT && !errors;
+  ESP_LOGI(TAG,
+           "%d%% loss: %s, %lu records in %lld ms, %lu dropped, %lu "
+           "retransmitted, RTT %lu us",
+           lossRate, passed ? "passed" : "FAILED", expected, elapsed / 1000,
+           stats.lost, stats.retransmits, stats.rttUs);
+  return passed;
+}
+
+void app_main(void) {
+  ESP_ERROR_CHECK(esp_netif_init());  // starts lwIP, loopback included
+  const uint8_t lossRates[] = {0, 1, 5, 20};
+  int failed = 0;
+  for (int i = 0; i < sizeof(lossRates); i++) {
+    if (!runTest(lossRates[i])) {
+      failed++;
+    }
+  }
+  ESP_LOGI(TAG, "%d of %d tests failed", failed, sizeof(lossRates));
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,103 @@
+#include <stdio.h>
+
+#include "TCPClient.h"
+#include "TCPServer.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Loopback benchmark for TCPServer: round trip latency of small messages and
+// one-way throughput, both over 127.0.0.1 (no radio involved)
+
+#define BENCH_PORT 8088
+#define PING_SIZE 32
+#define PING_COUNT 1000
+#define BULK_BYTES (1024 * 1024)
+#define BULK_CHUNK 1436
+
+#ifdef __cplusplus
+extern "C" {
+void app_main(void);
+}
+#endif
+
+static const char *TAG = "Bench";
+
+static uint8_t chunk[BULK_CHUNK];
+
+// echo fixed size messages back
+static void echoHandler(TCPClient &client, void *arg) {
+  uint8_t message[PING_SIZE];
+  while (client.read(message, PING_SIZE) == PING_SIZE) {
+    client.write(message, PING_SIZE);
+  }
+}
+
+// count what comes in, answer the total once the client is done sending
+static void sinkHandler(TCPClient &client, void *arg) {
+  uint8_t buffer[BULK_CHUNK];
+  int32_t total = 0;
+  int received;
+  while ((received = client.read(buffer, sizeof(buffer))) > 0) {
+    total += received;
+    if (total >= BULK_BYTES) {
+      break;
+    }
+  }
+  client.write((uint8_t *)&total, sizeof(total));
+}
+
+static void benchLatency(void) {
+  TCPServer server(512);
+  server.begin(BENCH_PORT, echoHandler);
+  TCPClient client(512);
+  client.setNoDelay(true);
+  if (!client.connect(IPAddress(127, 0, 0, 1), BENCH_PORT, 1000)) {
+    ESP_LOGE(TAG, "Could not connect");
+    return;
+  }
+  uint8_t message[PING_SIZE] = {0};
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < PING_COUNT; i++) {
+    client.write(message, PING_SIZE);
+    if (client.read(message, PING_SIZE) != PING_SIZE) {
+      ESP_LOGE(TAG, "Echo failed");
+      return;
+    }
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+  ESP_LOGI(TAG, "Latency: %lld us per %d bytes round trip (%d samples)",
+           elapsed / PING_COUNT, PING_SIZE, PING_COUNT);
+  client.close();
+  server.stop();
+}
+
+static void benchThroughput(void) {
+  TCPServer server(BULK_CHUNK);
+  server.begin(BENCH_PORT, sinkHandler);
+  TCPClient client(64);
+  if (!client.connect(IPAddress(127, 0, 0, 1), BENCH_PORT, 1000)) {
+    ESP_LOGE(TAG, "Could not connect");
+    return;
+  }
+  int64_t start = esp_timer_get_time();
+  for (int sent = 0; sent < BULK_BYTES; sent += sizeof(chunk)) {
+    client.write(chunk, min(sizeof(chunk), (size_t)(BULK_BYTES - sent)));
+  }
+  int32_t total = 0;
+  client.read((uint8_t *)&total, sizeof(total));
+  int64_t elapsed = esp_timer_get_time() - start;
+  ESP_LOGI(TAG, "Throughput: %lld KB/s (%ld bytes in %lld ms)",
+           (int64_t)total * 1000000 / 1024 / elapsed, total, elapsed / 1000);
+  client.close();
+  server.stop();
+}
+
+void app_main(void) {
+  ESP_ERROR_CHECK(esp_netif_init());  // starts lwIP, loopback included
+  benchLatency();
+  benchThroughput();
+  vTaskDelete(NULL);
+}
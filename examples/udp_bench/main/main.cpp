@@ -0,0 +1,119 @@
+#include <stdio.h>
+
+#include "TokenBucket.h"
+#include "UDPClient.h"
+#include "esp_log.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// Loopback benchmark for UDPClient writes: telemetry records sent byte by
+// byte, in bulk filling whole datagrams, in bulk one record per write()
+// kept whole, and paced by a token bucket, over 127.0.0.1 (no radio
+// involved)
+
+#define BENCH_PORT 8089
+#define RECORD_SIZE 48
+#define RECORD_COUNT 20000
+#define PACED_RATE (256 * 1024)  // bytes/s
+
+#ifdef __cplusplus
+extern "C" {
+void app_main(void);
+}
+#endif
+
+static const char *TAG = "Bench";
+
+static volatile bool receiving = false;
+static volatile uint32_t received = 0;
+
+// count incoming datagrams until told to stop
+static void receiverTask(void *arg) {
+  UDPClient *receiver = (UDPClient *)arg;
+  while (receiving) {
+    if (receiver->waitAvailable(100)) {
+      while (receiver->parsePacket() > 0) {
+        received = received + 1;
+      }
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+static void benchWrite(const char *name, udpOverflowMode mode, bool perByte,
+                       TokenBucket *pacer = NULL) {
+  UDPClient sender;
+  sender.begin(ipNull, 0);
+  sender.setOverflowMode(mode);
+  sender.setPacer(pacer);
+  if (!sender.beginPacket(IPAddress(127, 0, 0, 1), BENCH_PORT)) {
+    ESP_LOGE(TAG, "Could not start a packet");
+    return;
+  }
+  uint8_t record[RECORD_SIZE];
+  for (int i = 0; i < RECORD_SIZE; i++) {
+    record[i] = i;
+  }
+  received = 0;
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < RECORD_COUNT; i++) {
+    if (perByte) {
+      for (int j = 0; j < RECORD_SIZE; j++) {
+        sender.write(record[j]);
+      }
+    } else {
+      sender.write(record, RECORD_SIZE);
+    }
+  }
+  sender.endPacket();
+  int64_t elapsed = esp_timer_get_time() - start;
+  vTaskDelay(pdMS_TO_TICKS(200));  // let the receiver catch up
+
+  uint32_t datagrams;
+  if (mode == UDP_OVERFLOW_SPLIT) {
+    int perPacket = UDP_MAX_PAYLOAD / RECORD_SIZE;
+    datagrams = (RECORD_COUNT + perPacket - 1) / perPacket;
+  } else {
+    datagrams = (RECORD_COUNT * RECORD_SIZE + UDP_MAX_PAYLOAD - 1) /
+                UDP_MAX_PAYLOAD;
+  }
+  ESP_LOGI(TAG,
+           "%s: %lu datagrams in %lld ms, %lld datagrams/s, %lld KB/s "
+           "(%lu received)",
+           name, datagrams, elapsed / 1000,
+           (int64_t)datagrams * 1000000 / elapsed,
+           (int64_t)RECORD_COUNT * RECORD_SIZE * 1000000 / 1024 / elapsed,
+           received);
+  if (pacer) {
+    tokenBucketStats stats;
+    pacer->getStats(stats);
+    ESP_LOGI(TAG, "%s: %lu of %lu packets delayed, %llu us total, %lu us max",
+             name, stats.delayed, stats.packets, stats.delayUs,
+             stats.maxDelayUs);
+  }
+  sender.stop();
+}
+
+void app_main(void) {
+  ESP_ERROR_CHECK(esp_netif_init());  // starts lwIP, loopback included
+  UDPClient receiver;
+  if (!receiver.begin(BENCH_PORT)) {
+    ESP_LOGE(TAG, "Could not bind port %d", BENCH_PORT);
+    vTaskDelete(NULL);
+  }
+  receiving = true;
+  xTaskCreate(receiverTask, "receiver", 4096, &receiver, 5, NULL);
+
+  benchWrite("Per byte", UDP_OVERFLOW_FLUSH, true);
+  benchWrite("Bulk, flush", UDP_OVERFLOW_FLUSH, false);
+  benchWrite("Bulk, split", UDP_OVERFLOW_SPLIT, false);
+  TokenBucket pacer(PACED_RATE, 4 * UDP_MAX_PAYLOAD);
+  benchWrite("Bulk, paced", UDP_OVERFLOW_FLUSH, false, &pacer);
+
+  receiving = false;
+  vTaskDelay(pdMS_TO_TICKS(200));
+  receiver.stop();
+  vTaskDelete(NULL);
+}